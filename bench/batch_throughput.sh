@@ -0,0 +1,34 @@
+#!/bin/sh
+# Mide cuántos comandos por segundo ejecuta la shell en modo no interactivo,
+# con el script como argumento, redirigido a la entrada estándar y por una
+# tubería. Con un builtin (por defecto `cd .`) se mide el bucle de lectura y
+# parseo; con un comando externo, el lanzamiento de procesos.
+#
+# uso: bench/batch_throughput.sh [shell] [comandos] [línea]
+#   bench/batch_throughput.sh ./simple_shell 100000 "cd ."
+
+SHELL_BIN=${1:-./simple_shell}
+N=${2:-100000}
+LINE=${3:-"cd ."}
+
+now_ns() { date +%s%N; }
+
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+awk -v n="$N" -v l="$LINE" 'BEGIN { for (i = 0; i < n; i++) print l }' > "$script"
+
+run() {
+    mode=$1
+    t0=$(now_ns)
+    case $mode in
+        script) "$SHELL_BIN" "$script" >/dev/null ;;
+        stdin)  "$SHELL_BIN" < "$script" >/dev/null ;;
+        pipe)   cat "$script" | "$SHELL_BIN" >/dev/null ;;
+    esac
+    t1=$(now_ns)
+    awk -v m="$mode" -v n="$N" -v ns=$((t1 - t0)) \
+        'BEGIN { sec = ns / 1e9; printf "%-8s %10d %10.3f %12.0f\n", m, n, sec, n / sec }'
+}
+
+printf "%-8s %10s %10s %12s\n" modo comandos seg cmds/s
+for mode in script stdin pipe; do run "$mode"; done
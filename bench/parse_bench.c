@@ -0,0 +1,144 @@
+// Microbenchmark del parser: compara el camino anterior (strdup + strtok_r +
+// parse_args con un argv de 513 punteros por etapa) con parse_line sobre la
+// arena de línea. Cuenta las llamadas a malloc/calloc/realloc por línea.
+// Las líneas con comillas solo pasan por parse_line (el tokenizador anterior
+// no las entiende); las líneas simples sirven para comprobar que el camino
+// rápido sin comillas no se volvió más lento.
+//
+// gcc -O2 -o parse_bench bench/parse_bench.c -lm && ./parse_bench [iteraciones]
+
+#define main mishell_main
+#include "../simple_unix_shell.c"
+#undef main
+
+// Contador de asignaciones: reemplaza malloc y compañía de glibc
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+static unsigned long nallocs;
+
+void *malloc(size_t n) { nallocs++; return __libc_malloc(n); }
+void *calloc(size_t n, size_t m) { nallocs++; return __libc_calloc(n, m); }
+void *realloc(void *p, size_t n) { nallocs++; return __libc_realloc(p, n); }
+void free(void *p) { __libc_free(p); }
+
+#define LEGACY_MAX_TOKENS 512
+
+// Tokenizador previo, tal como lo usaban main, handle_single_command y
+// execute_pipeline
+char *legacy_trim(char *s) {
+    while (*s == ' ' || *s == '\t' || *s == '\n') s++;
+    char *end = s + strlen(s) - 1;
+    while (end > s && (*end == ' ' || *end == '\t' || *end == '\n')) *end-- = '\0';
+    return s;
+}
+
+int legacy_split_pipeline(char *line, char *commands[]) {
+    int n = 0;
+    char *saveptr;
+    char *tok = strtok_r(line, "|", &saveptr);
+    while (tok && n < MAX_COMMANDS) {
+        commands[n++] = legacy_trim(tok);
+        tok = strtok_r(NULL, "|", &saveptr);
+    }
+    return n;
+}
+
+char **legacy_parse_args(char *cmd) {
+    char **argv = malloc(sizeof(char*) * (LEGACY_MAX_TOKENS+1));
+    int i = 0;
+    char *saveptr;
+    char *tok = strtok_r(cmd, " \t\n", &saveptr);
+    while (tok && i < LEGACY_MAX_TOKENS) {
+        argv[i++] = tok;
+        tok = strtok_r(NULL, " \t\n", &saveptr);
+    }
+    argv[i] = NULL;
+    return argv;
+}
+
+// Parseo de execute_pipeline: una copia y un argv por etapa
+void legacy_pipeline(char *commands[], int n) {
+    char *copies[MAX_COMMANDS];
+    char **argvs[MAX_COMMANDS];
+    for (int i = 0; i < n; ++i) {
+        copies[i] = strdup(commands[i]);
+        argvs[i] = legacy_parse_args(copies[i]);
+    }
+    for (int i = 0; i < n; ++i) { free(argvs[i]); free(copies[i]); }
+}
+
+// Todo el parseo que hacía la shell por línea, sin ejecutar nada
+void legacy_line(char *line) {
+    char *trimmed = legacy_trim(line);
+    char *linecopy = strdup(trimmed);
+    char *commands[MAX_COMMANDS];
+    int ncmds = legacy_split_pipeline(linecopy, commands);
+    if (ncmds <= 1) {
+        // handle_single_command: copia para builtins y otra para execute_pipeline
+        char *copy = strdup(trimmed);
+        char **argv = legacy_parse_args(copy);
+        char *single = strdup(trimmed);
+        legacy_pipeline(&single, 1);
+        free(single); free(argv); free(copy);
+    } else {
+        char *cmdcopies[MAX_COMMANDS];
+        for (int i = 0; i < ncmds; ++i) cmdcopies[i] = strdup(commands[i]);
+        legacy_pipeline(cmdcopies, ncmds);
+        for (int i = 0; i < ncmds; ++i) free(cmdcopies[i]);
+    }
+    free(linecopy);
+}
+
+static const struct { const char *line; int quoted; } samples[] = {
+    { "ls -la /tmp\n", 0 },
+    { "grep -v debug app.log | sort | uniq -c | sort -rn | head -20\n", 0 },
+    { "zcat access.log.gz | awk {print} | cut -d, -f1,3,7 | sort -u | wc -l\n", 0 },
+    { "cc -O2 -Wall -Wextra -o out main.c util.c parse.c exec.c -lm -lpthread\n", 0 },
+    { "grep -E 'error|fatal' \"my app.log\" | awk '{print $1}' | sort\n", 1 },
+    { "cp report\\ final.pdf 'notes (v2).txt' \"/mnt/backup/2024 q1/\"\n", 1 },
+};
+#define NSAMPLES (sizeof(samples) / sizeof(samples[0]))
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    long iters = argc > 1 ? atol(argv[1]) : 1000000;
+    char buf[256];
+    struct arena a = {0};
+
+    printf("%-8s %-9s %12s %10s\n", "caso", "parser", "allocs", "ns");
+    for (size_t s = 0; s < NSAMPLES; ++s) {
+        const char *line = samples[s].line;
+        size_t len = strlen(line);
+        double t0, t1;
+
+        if (!samples[s].quoted) {
+            nallocs = 0;
+            t0 = now_sec();
+            for (long i = 0; i < iters; ++i) {
+                memcpy(buf, line, len + 1);
+                legacy_line(buf);
+            }
+            t1 = now_sec();
+            printf("%-8zu %-9s %12.2f %10.1f\n", s + 1, "strtok_r", (double)nallocs / iters, (t1 - t0) / iters * 1e9);
+        }
+
+        nallocs = 0;
+        t0 = now_sec();
+        for (long i = 0; i < iters; ++i) {
+            memcpy(buf, line, len + 1);
+            int err;
+            if (!parse_line(buf, len, &a, &err)) return 1;
+            arena_reset(&a);
+        }
+        t1 = now_sec();
+        printf("%-8zu %-9s %12.2f %10.1f\n", s + 1, samples[s].quoted ? "arena(q)" : "arena", (double)nallocs / iters, (t1 - t0) / iters * 1e9);
+    }
+    return 0;
+}
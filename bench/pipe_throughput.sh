@@ -0,0 +1,30 @@
+#!/bin/sh
+# Mide el rendimiento de tuberías de la shell según la capacidad de las
+# tuberías (pipesize) y la cantidad de etapas.
+#
+# uso: bench/pipe_throughput.sh [shell] [MiB] [tamaños] [etapas]
+#   bench/pipe_throughput.sh ./simple_shell 2048 "default 256K 1M" "2 3 4"
+
+SHELL_BIN=${1:-./simple_shell}
+MIB=${2:-1024}
+SIZES=${3:-"default 128K 256K 512K 1M"}
+STAGES=${4:-"2 3 4"}
+
+now_ns() { date +%s%N; }
+
+printf "%-10s %7s %10s %10s\n" pipesize etapas seg MiB/s
+for size in $SIZES; do
+    for n in $STAGES; do
+        # head | cat ... | wc: n etapas en total
+        line="head -c ${MIB}M /dev/zero"
+        i=2
+        while [ "$i" -lt "$n" ]; do line="$line | cat"; i=$((i + 1)); done
+        line="$line | wc -c"
+
+        t0=$(now_ns)
+        printf 'pipesize %s\n%s\n' "$size" "$line" | "$SHELL_BIN" >/dev/null
+        t1=$(now_ns)
+        awk -v s="$size" -v n="$n" -v mib="$MIB" -v ns=$((t1 - t0)) \
+            'BEGIN { sec = ns / 1e9; printf "%-10s %7d %10.3f %10.1f\n", s, n, sec, mib / sec }'
+    done
+done
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,319 +11,4138 @@
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/sched.h>
+
+extern char **environ;
 
-#define MAX_TOKENS 512
 #define MAX_COMMANDS 64
+#define PATH_CACHE_BUCKETS 64
+#define ARENA_BLOCK 4096
+#define MAX_REDIRS 16
+
+static volatile pid_t current_child = 0;
+// Grupo de procesos de la tubería en primer plano (recibe SIGINT completo)
+static volatile pid_t current_pgrp = 0;
+// Se levanta con cada SIGINT; wait lo usa para dejar de esperar
+static volatile sig_atomic_t got_sigint = 0;
+
+// SIGCHLD se bloquea en la shell y se recibe por este descriptor; los hijos
+// recuperan la máscara original antes de exec
+static int sigchld_fd = -1;
+static sigset_t orig_sigmask;
+// Señales que la shell ignora y los hijos recuperan (SIGTSTP, SIGTTIN)
+static sigset_t job_sigs;
+
+// Backend usado para lanzar procesos externos
+enum spawn_backend { SPAWN_FORK, SPAWN_POSIX };
+static enum spawn_backend spawn_backend = SPAWN_POSIX;
+// Cgroup v2 donde nacen los hijos (-1 = el de la shell); lo fija miprof --cgroup
+static int spawn_cgroup_fd = -1;
+
+// Hay prompt y avisos de trabajos (entrada estándar en una terminal, sin
+// script ni -c)
+static int interactive = 0;
+
+// Estado de espera de la última tubería o línea; exit sin argumento lo usa
+static int last_status = 0;
+
+// Capacidad de las tuberías entre etapas (0 = la del sistema, 64 KiB)
+static int pipe_size = 0;
+
+// Caché de rutas resueltas en PATH (nombre -> ruta absoluta)
+struct path_entry {
+    char *name;
+    char *path;
+    unsigned long hits;
+    struct path_entry *next;
+};
+static struct path_entry *path_cache[PATH_CACHE_BUCKETS];
+static char *path_cache_env = NULL; // valor de PATH con el que se llenó
+
+// Manejador de señal SIGINT (Ctrl-C)
+void sigint_handler(int sig) {
+    (void)sig;
+    got_sigint = 1;
+    if (current_pgrp > 0) {
+        kill(-current_pgrp, SIGINT);
+    } else if (current_child > 0) {
+        kill(current_child, SIGINT);
+    }
+}
+
+// Arena de memoria por línea: todo lo que produce el parser se libera de una
+// vez con arena_reset. Los bloques se conservan entre líneas, así que en
+// régimen estable parsear una línea no llama a malloc.
+struct arena_block {
+    struct arena_block *next;
+    size_t cap, used;
+    char data[];
+};
+struct arena {
+    struct arena_block *first, *cur;
+};
+
+void *arena_alloc(struct arena *a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    struct arena_block *b = a->cur;
+    while (b && b->cap - b->used < size) {
+        // Los bloques siguientes quedaron libres tras arena_reset
+        b = b->next;
+        if (b) b->used = 0;
+    }
+    if (!b) {
+        size_t cap = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        b = malloc(sizeof(*b) + cap);
+        b->cap = cap;
+        b->used = 0;
+        // Se enlaza después del bloque actual para reutilizarlo en adelante
+        if (a->cur) { b->next = a->cur->next; a->cur->next = b; }
+        else { b->next = NULL; a->first = b; }
+    }
+    a->cur = b;
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+void arena_reset(struct arena *a) {
+    a->cur = a->first;
+    if (a->cur) a->cur->used = 0;
+}
+
+// Devuelve todos los bloques
+void arena_free(struct arena *a) {
+    while (a->first) {
+        struct arena_block *next = a->first->next;
+        free(a->first);
+        a->first = next;
+    }
+    a->cur = NULL;
+}
+
+// Redirección de una etapa. Se aplican en orden en el hijo, después de
+// conectar las tuberías, así que '> f' o '2>&1' mandan sobre el '|'.
+enum redir_type { R_IN, R_OUT, R_APPEND, R_DUP };
+struct redir {
+    enum redir_type type;
+    int fd;              // descriptor redirigido
+    int dupfd;           // R_DUP: descriptor de origen (-1 = cerrar)
+    char *target;        // R_IN, R_OUT, R_APPEND: archivo
+    struct redir *next;
+};
+
+// Una etapa de tubería
+struct command {
+    char **argv;   // terminado en NULL
+    int argc;
+    struct redir *redirs;
+    int nredirs;
+};
+
+// Tubería de ncmds etapas
+struct pipeline {
+    struct command *cmds;
+    int ncmds;
+};
+
+// Builtin: nombre, función (devuelve el código de salida) y los datos de
+// sus argumentos, que comparten la validación, help y compgen. La tabla está
+// junto a builtin_call.
+struct builtin {
+    const char *name;
+    int (*fn)(char **argv);
+    int min_args, max_args;     // sin contar el nombre (-1 = sin límite)
+    const char *usage;
+    const char *help;
+};
+const struct builtin *find_builtin(const char *name);
+int builtin_call(const struct builtin *b, char **argv);
+
+// Lista de tuberías unidas por ';', '&&', '||' o '&' (esta en segundo plano)
+enum list_op { L_SEQ, L_AND, L_OR, L_BG };
+struct cmdlist {
+    struct pipeline pl;
+    enum list_op op;        // cómo se une con la siguiente
+    struct cmdlist *next;
+};
+
+// Clases de carácter del lexer
+enum { CH_WORD, CH_END, CH_SPACE, CH_OP, CH_QUOTE };
+static const unsigned char lex_class[256] = {
+    ['\0'] = CH_END, [' '] = CH_SPACE, ['\t'] = CH_SPACE, ['\n'] = CH_SPACE,
+    ['|'] = CH_OP, ['<'] = CH_OP, ['>'] = CH_OP, [';'] = CH_OP, ['&'] = CH_OP,
+    ['\''] = CH_QUOTE, ['"'] = CH_QUOTE, ['\\'] = CH_QUOTE,
+};
+
+// Continúa una palabra que contiene comillas o barras invertidas a partir de
+// p, quitándolas en el lugar. Comillas simples: todo literal. Dobles: la barra
+// solo escapa " \ $ y `. Fuera de comillas la barra escapa cualquier carácter.
+// No hay líneas de continuación: la entrada llega ya cortada en '\n', así que
+// una barra al final de la línea se descarta. Devuelve el primer
+// carácter tras la palabra, o NULL si quedaron comillas sin cerrar; *wend
+// recibe el fin de la palabra (siempre anterior al valor devuelto).
+char *lex_quoted(char *p, char **wend) {
+    char *w = p;
+    while (1) {
+        int c = lex_class[(unsigned char)*p];
+        if (c == CH_WORD) { *w++ = *p++; continue; }
+        if (c != CH_QUOTE) break;
+        char q = *p++;
+        if (q == '\\') {
+            if (*p != '\0') *w++ = *p++;
+        } else if (q == '\'') {
+            while (*p && *p != '\'') *w++ = *p++;
+            if (!*p) return NULL;
+            p++;
+        } else {
+            while (*p && *p != '"') {
+                if (*p == '\\' && p[1] && strchr("\"\\$`", p[1])) p++;
+                *w++ = *p++;
+            }
+            if (!*p) return NULL;
+            p++;
+        }
+    }
+    *wend = w;
+    return p;
+}
+
+// Analiza line en una sola pasada y devuelve la lista de tuberías. Las
+// palabras se terminan en el lugar (los argv y archivos de redirección
+// apuntan dentro de line) y las estructuras se toman de la arena. Devuelve
+// NULL si la línea está vacía o tiene un error; en este caso *err queda en 1.
+struct cmdlist *parse_line(char *line, size_t len, struct arena *a, int *err) {
+    *err = 0;
+    // Cotas: cada palabra ocupa al menos un carácter y un separador, más
+    // un NULL por etapa; cada etapa tiene al menos una palabra
+    char **words = arena_alloc(a, sizeof(char*) * (len + 2));
+    struct command *cmds = arena_alloc(a, sizeof(struct command) * (len / 2 + 2));
+    struct cmdlist *head = NULL, **ltail = &head;
+    struct cmdlist *curl = NULL;  // tubería en construcción
+    int need = 0;                 // tras '|', '&&' o '||' debe venir un comando
+    int ncmds = 0;
+    struct command *cur = NULL;
+    struct redir **rtail = NULL;
+    struct redir *want = NULL;  // redirección que espera su archivo
+    char *p = line;
+    int pending = 0;            // operador ya consumido al cortar la palabra previa
+    int nw = 0;
+
+    while (1) {
+        char *word = NULL;
+        int iofd = -1;
+        int c = pending;
+        pending = 0;
+        if (!c) {
+            while (lex_class[(unsigned char)*p] == CH_SPACE) p++;
+            c = (unsigned char)*p;
+            if (lex_class[c] == CH_OP) {
+                p++;
+            } else if (c != '\0') {
+                // Camino rápido: argumento sin comillas seguido de espacio,
+                // se corta en el lugar
+                word = p;
+                while (lex_class[(unsigned char)*p] == CH_WORD) p++;
+                if (lex_class[(unsigned char)*p] == CH_SPACE && cur && !want) {
+                    *p++ = '\0';
+                    words[nw++] = word;
+                    cur->argc++;
+                    continue;
+                }
+                char *end = p;
+                if (lex_class[(unsigned char)*p] == CH_QUOTE && !(p = lex_quoted(p, &end))) {
+                    fprintf(stderr, "mishell: error de sintaxis: comillas sin cerrar\n");
+                    goto fail;
+                }
+                // El delimitador se lee antes de pisarlo con el terminador;
+                // '\0' no se consume y cierra la línea en la vuelta siguiente
+                c = (unsigned char)*p;
+                *end = '\0';
+                if (c != '\0') p++;
+                if (lex_class[c] == CH_OP) {
+                    // Un dígito pegado a '<' o '>' es el descriptor (2>, 0<)
+                    if ((c == '<' || c == '>') && end == word + 1 && *word >= '0' && *word <= '9' && !want) {
+                        iofd = *word - '0';
+                        word = NULL;
+                    } else {
+                        pending = c;
+                    }
+                }
+            }
+        }
+
+        if (want && !word) {
+            fprintf(stderr, "mishell: error de sintaxis: falta el destino de la redirección\n");
+            goto fail;
+        }
+        if (!word && c != '<' && c != '>') {
+            // Fin de etapa: '|', ';', '&', '&&', '||' o fin de línea
+            const char *op = c == ';' ? ";" : c == '&' ? "&" : "|";
+            if (c == '|' && *p == '|') { p++; op = "||"; }
+            else if (c == '&' && *p == '&') { p++; op = "&&"; }
+            if (cur) {
+                if (cur->argc == 0) {
+                    fprintf(stderr, "mishell: error de sintaxis: redirección sin comando\n");
+                    goto fail;
+                }
+                words[nw++] = NULL;
+                cur = NULL;
+            } else if (c != '\0' || need) {
+                fprintf(stderr, "mishell: error de sintaxis cerca de '%s'\n", c ? op : "fin de línea");
+                goto fail;
+            }
+            if (c == '\0') break;
+            need = op[1] != '\0' || c == '|';
+            if (op[1] == '\0' && c == '|') continue;
+            // Cierra la tubería y la une con la siguiente
+            curl->op = c == ';' ? L_SEQ : op[1] == '\0' ? L_BG : c == '&' ? L_AND : L_OR;
+            curl = NULL;
+            continue;
+        }
+        if (!cur) {
+            if (!curl) {
+                curl = arena_alloc(a, sizeof(*curl));
+                curl->pl.cmds = &cmds[ncmds];
+                curl->pl.ncmds = 0;
+                curl->op = L_SEQ;
+                curl->next = NULL;
+                *ltail = curl;
+                ltail = &curl->next;
+            }
+            struct pipeline *pl = &curl->pl;
+            if (pl->ncmds == MAX_COMMANDS) {
+                fprintf(stderr, "mishell: demasiadas etapas (máximo %d)\n", MAX_COMMANDS);
+                goto fail;
+            }
+            cur = &pl->cmds[pl->ncmds++];
+            ncmds++;
+            cur->argv = &words[nw];
+            cur->argc = 0;
+            cur->redirs = NULL;
+            cur->nredirs = 0;
+            rtail = &cur->redirs;
+            need = 0;
+        }
+
+        if (word && !want) {
+            words[nw++] = word;
+            cur->argc++;
+            continue;
+        }
+        if (word) {
+            // Archivo o descriptor de la redirección pendiente
+            want->target = word;
+            if (want->type == R_DUP) {
+                if (word[0] >= '0' && word[0] <= '9' && word[1] == '\0') want->dupfd = word[0] - '0';
+                else if (strcmp(word, "-") != 0) {
+                    fprintf(stderr, "mishell: %s: descriptor inválido en la redirección\n", word);
+                    goto fail;
+                }
+            }
+            *rtail = want;
+            rtail = &want->next;
+            want = NULL;
+            continue;
+        }
+
+        // Operador de redirección: < > >> <& >&
+        if (cur->nredirs == MAX_REDIRS) {
+            fprintf(stderr, "mishell: demasiadas redirecciones (máximo %d)\n", MAX_REDIRS);
+            goto fail;
+        }
+        cur->nredirs++;
+        want = arena_alloc(a, sizeof(*want));
+        want->fd = iofd != -1 ? iofd : c == '<' ? 0 : 1;
+        want->dupfd = -1;
+        want->next = NULL;
+        if (*p == '&') { p++; want->type = R_DUP; }
+        else if (c == '<') want->type = R_IN;
+        else if (*p == '>') { p++; want->type = R_APPEND; }
+        else want->type = R_OUT;
+    }
+    return head;
+fail:
+    *err = 1;
+    return NULL;
+}
+
+// Estadísticas de la propia shell (builtin stats): cuánto tarda cada fase
+// que la shell agrega alrededor de los comandos. Siempre activas: medir una
+// fase son dos lecturas de CLOCK_MONOTONIC (vDSO, sin llamada al sistema) y
+// un incremento en un histograma log-lineal al estilo HDR: 8 casillas por
+// potencia de 2, o sea ~12% de resolución de 1ns a siglos, en 4 KiB por fase.
+enum stat_phase { ST_READ, ST_PARSE, ST_PATH, ST_SPAWN, ST_WAIT, ST_PROMPT, NSTAT_PHASES };
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+struct phase_hist {
+    unsigned long long count, total_ns, max_ns;
+    unsigned hist[HIST_BUCKETS];
+};
+static struct phase_hist shell_stats[NSTAT_PHASES];
+
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Casilla de v: exponente (bit más alto) y los 3 bits siguientes. Debajo de
+// 8 cada valor tiene su casilla.
+unsigned hist_bucket(unsigned long long v) {
+    if (v < (1u << HIST_SUB_BITS)) return v;
+    int msb = 63 - __builtin_clzll(v);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | ((v >> (msb - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+}
+
+// Mayor valor que cae en la casilla b
+unsigned long long hist_upper(unsigned b) {
+    if (b < (1u << HIST_SUB_BITS)) return b;
+    int shift = (b >> HIST_SUB_BITS) - 1;
+    unsigned long long lo = (unsigned long long)((1u << HIST_SUB_BITS) | (b & ((1u << HIST_SUB_BITS) - 1))) << shift;
+    return lo + (1ULL << shift) - 1;
+}
+
+void stat_add(enum stat_phase p, long long ns) {
+    struct phase_hist *h = &shell_stats[p];
+    if (ns < 0) ns = 0;
+    h->count++;
+    h->total_ns += ns;
+    if ((unsigned long long)ns > h->max_ns) h->max_ns = ns;
+    h->hist[hist_bucket(ns)]++;
+}
+
+// Traza de ejecución en formato Chrome trace-event (se abre en Perfetto o
+// chrome://tracing). Registrar un evento solo lee el reloj y copia una
+// estructura a un anillo fijo, sin formatear ni hacer llamadas al sistema;
+// el JSON se arma y se escribe cuando la shell está ociosa (antes de leer la
+// línea siguiente), fuera de las fases medidas. Si el anillo se llena antes,
+// los eventos nuevos se descartan y se cuentan.
+#define TRACE_RING 16384           // potencia de 2
+struct trace_event {
+    long long ts, dur;             // ns de CLOCK_MONOTONIC
+    int tid;                       // la shell o el pid de un hijo
+    char ph;                       // B, E, X (tramo completo) o M (nombre de hilo)
+    const char *name;              // literal
+    char arg[32];                  // comando, truncado
+};
+static struct trace_event *trace_ring = NULL;
+static unsigned trace_head = 0, trace_tail = 0;
+static unsigned long trace_dropped = 0;
+static int trace_fd = -1;
+static pid_t trace_pid = 0;        // dueño del archivo (no los hijos sin exec)
+
+void trace_push(char ph, const char *name, int tid, long long ts, long long dur, const char *arg) {
+    if (trace_head - trace_tail == TRACE_RING) { trace_dropped++; return; }
+    struct trace_event *e = &trace_ring[trace_head++ & (TRACE_RING - 1)];
+    e->ts = ts;
+    e->dur = dur;
+    e->tid = tid;
+    e->ph = ph;
+    e->name = name;
+    // Se copia ya apto para JSON: comillas, barras y controles quedan como '?'
+    size_t i = 0;
+    for (; arg && arg[i] && i < sizeof(e->arg) - 1; ++i)
+        e->arg[i] = arg[i] == '"' || arg[i] == '\\' || (unsigned char)arg[i] < 0x20 ? '?' : arg[i];
+    e->arg[i] = '\0';
+}
+
+// Fases de la shell
+void trace_begin(const char *name, const char *arg) {
+    if (trace_ring) trace_push('B', name, trace_pid, now_ns(), 0, arg);
+}
+
+void trace_end(const char *name) {
+    if (trace_ring) trace_push('E', name, trace_pid, now_ns(), 0, NULL);
+}
+
+// Vida de un hijo, como tramo completo en su propia pista
+void trace_span(const char *name, pid_t pid, const struct timespec *start, const struct timespec *end) {
+    if (!trace_ring) return;
+    long long s = start->tv_sec * 1000000000LL + start->tv_nsec;
+    long long e = end->tv_sec * 1000000000LL + end->tv_nsec;
+    trace_push('X', name, pid, s, e - s, NULL);
+}
+
+// Nombra la pista de un hijo con su comando
+void trace_thread(pid_t pid, const char *cmd) {
+    if (trace_ring) trace_push('M', "thread_name", pid, 0, 0, cmd);
+}
+
+// Escribe buf entero en el archivo. Si falla, informa y deja de trazar, así
+// el error se ve una sola vez
+int trace_write(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(trace_fd, buf, len);
+        if (w == -1 && errno == EINTR) continue;
+        if (w == -1) {
+            perror("mishell: traza");
+            close(trace_fd);
+            trace_fd = -1;
+            free(trace_ring);
+            trace_ring = NULL;
+            return -1;
+        }
+        buf += w;
+        len -= w;
+    }
+    return 0;
+}
+
+// Escribe lo acumulado. Con force se vacía aunque el anillo esté casi vacío;
+// si no, se espera a que junte medio anillo para no hacer un write por línea
+void trace_flush(int force) {
+    if (!trace_ring || getpid() != trace_pid) return;
+    if (!force && trace_head - trace_tail < TRACE_RING / 2 && !trace_dropped) return;
+    char buf[65536];
+    size_t len = 0;
+    while (trace_tail != trace_head || trace_dropped) {
+        char ev[256];
+        int n;
+        if (trace_tail == trace_head) {
+            n = snprintf(ev, sizeof(ev), "{\"name\":\"eventos descartados\",\"ph\":\"i\",\"s\":\"g\","
+                "\"pid\":%d,\"tid\":%d,\"ts\":%lld,\"args\":{\"n\":%lu}}", (int)trace_pid, (int)trace_pid,
+                now_ns() / 1000, trace_dropped);
+            trace_dropped = 0;
+        } else {
+            const struct trace_event *e = &trace_ring[trace_tail++ & (TRACE_RING - 1)];
+            if (e->ph == 'M')
+                n = snprintf(ev, sizeof(ev), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                    "\"args\":{\"name\":\"%s (%d)\"}}", (int)trace_pid, e->tid, e->arg, e->tid);
+            // ts y dur van en microsegundos; se formatean como enteros, que
+            // es bastante más rápido que con %f
+            else if (e->ph == 'X')
+                n = snprintf(ev, sizeof(ev), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%lld.%03lld,\"dur\":%lld.%03lld}", e->name, (int)trace_pid, e->tid,
+                    e->ts / 1000, e->ts % 1000, e->dur / 1000, e->dur % 1000);
+            else if (e->arg[0])
+                n = snprintf(ev, sizeof(ev), "{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%lld.%03lld,\"args\":{\"cmd\":\"%s\"}}", e->name, e->ph, (int)trace_pid, e->tid,
+                    e->ts / 1000, e->ts % 1000, e->arg);
+            else
+                n = snprintf(ev, sizeof(ev), "{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%lld.%03lld}", e->name, e->ph, (int)trace_pid, e->tid, e->ts / 1000, e->ts % 1000);
+        }
+        if (len + n + 2 > sizeof(buf)) {
+            if (trace_write(buf, len) == -1) return;
+            len = 0;
+        }
+        // El primer elemento del arreglo lo escribió trace_start
+        memcpy(buf + len, ",\n", 2);
+        len += 2;
+        memcpy(buf + len, ev, n);
+        len += n;
+    }
+    if (len > 0) trace_write(buf, len);
+}
+
+// Cierra el arreglo JSON y suelta el anillo
+void trace_stop(void) {
+    if (!trace_ring || getpid() != trace_pid) return;
+    trace_flush(1);
+    if (!trace_ring || trace_write("\n]\n", 3) == -1) return;
+    close(trace_fd);
+    trace_fd = -1;
+    free(trace_ring);
+    trace_ring = NULL;
+}
+
+int trace_start(const char *path) {
+    trace_stop();
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return -1;
+    trace_pid = getpid();
+    char head[128];
+    int n = snprintf(head, sizeof(head), "[{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+        "\"args\":{\"name\":\"mishell\"}}", (int)trace_pid);
+    // El que llama informa del error con errno
+    if (write(fd, head, n) != n) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    trace_ring = malloc(sizeof(struct trace_event) * TRACE_RING);
+    trace_head = trace_tail = 0;
+    trace_dropped = 0;
+    trace_fd = fd;
+    return 0;
+}
+
+// Hash FNV-1a del nombre de comando
+unsigned path_hash(const char *name) {
+    unsigned h = 2166136261u;
+    while (*name) { h ^= (unsigned char)*name++; h *= 16777619u; }
+    return h % PATH_CACHE_BUCKETS;
+}
+
+// Vacía la caché de rutas
+void path_cache_clear(void) {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; ++i) {
+        struct path_entry *e = path_cache[i];
+        while (e) {
+            struct path_entry *next = e->next;
+            free(e->name); free(e->path); free(e);
+            e = next;
+        }
+        path_cache[i] = NULL;
+    }
+}
+
+// Descarta la entrada de un comando (p. ej. si su ruta dejó de existir)
+void path_cache_forget(const char *name) {
+    struct path_entry **pp = &path_cache[path_hash(name)];
+    while (*pp) {
+        if (strcmp((*pp)->name, name) == 0) {
+            struct path_entry *e = *pp;
+            *pp = e->next;
+            free(e->name); free(e->path); free(e);
+            return;
+        }
+        pp = &(*pp)->next;
+    }
+}
+
+// Busca name en cada directorio de PATH. Devuelve ruta en memoria dinámica o NULL
+char *search_path(const char *name, const char *pathenv) {
+    size_t nlen = strlen(name);
+    const char *dir = pathenv;
+    while (1) {
+        const char *end = strchrnul(dir, ':');
+        size_t dlen = end - dir;
+        char *cand = malloc(dlen + nlen + 3);
+        if (dlen == 0) { cand[0] = '.'; dlen = 1; } // elemento vacío = directorio actual
+        else memcpy(cand, dir, dlen);
+        cand[dlen] = '/';
+        memcpy(cand + dlen + 1, name, nlen + 1);
+        struct stat st;
+        if (access(cand, X_OK) == 0 && stat(cand, &st) == 0 && S_ISREG(st.st_mode)) return cand;
+        free(cand);
+        if (*end == '\0') return NULL;
+        dir = end + 1;
+    }
+}
+
+// Devuelve el PATH vigente; si cambió, todo lo resuelto antes deja de valer
+const char *path_cache_sync(void) {
+    const char *pathenv = getenv("PATH");
+    if (!pathenv) pathenv = "/bin:/usr/bin";
+    if (!path_cache_env || strcmp(path_cache_env, pathenv) != 0) {
+        path_cache_clear();
+        free(path_cache_env);
+        path_cache_env = strdup(pathenv);
+    }
+    return pathenv;
+}
+
+// Busca name en la caché y, si no está, en PATH. Las rutas relativas
+// (elementos de PATH relativos) dependen del directorio actual y no se guardan:
+// si relative no es NULL recibe esa ruta en memoria dinámica (o NULL si el
+// comando no existe), para no recorrer PATH otra vez. *found indica si la
+// entrada ya existía.
+struct path_entry *path_cache_lookup(const char *name, int *found, char **relative) {
+    const char *pathenv = path_cache_sync();
+    unsigned h = path_hash(name);
+    *found = 1;
+    if (relative) *relative = NULL;
+    for (struct path_entry *e = path_cache[h]; e; e = e->next)
+        if (strcmp(e->name, name) == 0) return e;
+
+    *found = 0;
+    char *path = search_path(name, pathenv);
+    if (!path) return NULL;
+    if (path[0] != '/') {
+        if (relative) *relative = path;
+        else free(path);
+        return NULL;
+    }
+    struct path_entry *e = malloc(sizeof(*e));
+    e->name = strdup(name);
+    e->path = path;
+    e->hits = 0;
+    e->next = path_cache[h];
+    path_cache[h] = e;
+    return e;
+}
+
+// Resuelve un comando a ruta ejecutable. *cached indica si la ruta ya estaba
+// en la caché (y por tanto podría estar obsoleta).
+const char *resolve_command(const char *name, int *cached) {
+    static char *relative = NULL;
+    *cached = 0;
+    if (strchr(name, '/')) return name;
+
+    long long t0 = now_ns();
+    const char *path;
+    // Sin entrada: no existe o se halló vía un elemento relativo de PATH
+    free(relative);
+    struct path_entry *e = path_cache_lookup(name, cached, &relative);
+    if (e) {
+        e->hits++;
+        path = e->path;
+    } else {
+        path = relative;
+    }
+    stat_add(ST_PATH, now_ns() - t0);
+    return path;
+}
+
+void close_redirs(int fds[], int n) {
+    for (int i = 0; i < n; ++i) if (fds[i] != -1) close(fds[i]);
+}
+
+// Abre en la shell los archivos de las redirecciones y deja en fds[] el
+// descriptor de cada una (-1 para R_DUP), en orden. Quedan con O_CLOEXEC y
+// por encima de 9, así no chocan con los descriptores redirigidos. Devuelve
+// -1 e informa si alguno no se pudo abrir (los ya abiertos se cierran).
+int open_redirs(const struct redir *r, int fds[]) {
+    int n = 0;
+    for (; r; r = r->next, ++n) {
+        fds[n] = -1;
+        if (r->type == R_DUP) continue;
+        int flags = r->type == R_IN ? O_RDONLY
+                  : r->type == R_OUT ? O_WRONLY | O_CREAT | O_TRUNC
+                  : O_WRONLY | O_CREAT | O_APPEND;
+        int fd = open(r->target, flags | O_CLOEXEC, 0666);
+        if (fd != -1 && fd < 10) {
+            int hi = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+            close(fd);
+            fd = hi;
+        }
+        if (fd == -1) {
+            fprintf(stderr, "mishell: %s: %s\n", r->target, strerror(errno));
+            close_redirs(fds, n);
+            return -1;
+        }
+        fds[n] = fd;
+    }
+    return n;
+}
+
+// Aplica las redirecciones en el proceso actual (hijo tras fork o builtin)
+int apply_redirs(const struct redir *r, const int fds[]) {
+    for (int i = 0; r; r = r->next, ++i) {
+        int err;
+        if (r->type != R_DUP) err = dup2(fds[i], r->fd);
+        // Como en sh (y posix_spawn), cerrar un descriptor ya cerrado no es error
+        else if (r->dupfd == -1) err = close(r->fd) == -1 && errno != EBADF ? -1 : 0;
+        else err = dup2(r->dupfd, r->fd);
+        if (err == -1) {
+            fprintf(stderr, "mishell: %d: %s\n", r->type == R_DUP && r->dupfd != -1 ? r->dupfd : r->fd, strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// fork que hace nacer al hijo ya dentro del cgroup cgfd (clone3 con
+// CLONE_INTO_CGROUP), sin un instante en el de la shell. Sin clone3 el hijo
+// se mueve solo escribiendo en cgroup.procs antes de seguir.
+pid_t fork_into_cgroup(int cgfd) {
+    struct clone_args ca;
+    memset(&ca, 0, sizeof(ca));
+    ca.flags = CLONE_INTO_CGROUP;
+    ca.exit_signal = SIGCHLD;
+    ca.cgroup = cgfd;
+    pid_t pid = syscall(SYS_clone3, &ca, sizeof(ca));
+    if (pid != -1 || (errno != ENOSYS && errno != E2BIG)) return pid;
+    pid = fork();
+    if (pid == 0) {
+        int fd = openat(cgfd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+        if (fd == -1 || write(fd, "0", 1) != 1) {
+            fprintf(stderr, "mishell: cgroup.procs: %s\n", strerror(errno));
+            _exit(126);
+        }
+        close(fd);
+    }
+    return pid;
+}
+
+// Lanza argv con stdin/stdout/stderr conectados a in_fd/out_fd/err_fd y luego
+// las redirecciones de la etapa. Los descriptores de las tuberías deben tener
+// O_CLOEXEC para que el hijo no herede extremos sobrantes. pgid < 0 deja al
+// hijo en el grupo de la shell, 0 crea un grupo nuevo con el hijo como líder
+// y > 0 lo une a ese grupo. Devuelve el pid, o -1 con errno asignado tras
+// informar el error.
+pid_t spawn_command(char **argv, const struct redir *redirs, int in_fd, int out_fd, int err_fd, pid_t pgid) {
+    // Como en sh, los archivos se abren (y truncan) aunque el comando no exista
+    int rfds[MAX_REDIRS];
+    if (open_redirs(redirs, rfds) == -1) { errno = EBADF; return -1; }
+    int nr = 0;
+    for (const struct redir *r = redirs; r; r = r->next) nr++;
+
+    // Un builtin (como etapa, perfilado o en segundo plano) corre en un hijo
+    // sin exec
+    const struct builtin *b = find_builtin(argv[0]);
+    if (b && !b->fn) b = NULL;
+
+    int cached = 0;
+    const char *path = b ? argv[0] : resolve_command(argv[0], &cached);
+    if (!path) {
+        close_redirs(rfds, nr);
+        fprintf(stderr, "mishell: %s: %s\n", argv[0], strerror(ENOENT));
+        errno = ENOENT;
+        return -1;
+    }
+
+    // posix_spawn no sabe elegir el cgroup del hijo
+    if (spawn_backend == SPAWN_POSIX && !b && spawn_cgroup_fd == -1) {
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init(&fa);
+        if (in_fd != STDIN_FILENO) posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+        if (out_fd != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+        if (err_fd != STDERR_FILENO) posix_spawn_file_actions_adddup2(&fa, err_fd, STDERR_FILENO);
+        int i = 0;
+        for (const struct redir *r = redirs; r; r = r->next, ++i) {
+            if (r->type != R_DUP) posix_spawn_file_actions_adddup2(&fa, rfds[i], r->fd);
+            else if (r->dupfd == -1) posix_spawn_file_actions_addclose(&fa, r->fd);
+            else posix_spawn_file_actions_adddup2(&fa, r->dupfd, r->fd);
+        }
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setsigmask(&attr, &orig_sigmask);
+        posix_spawnattr_setsigdefault(&attr, &job_sigs);
+        short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+        if (pgid >= 0) {
+            posix_spawnattr_setpgroup(&attr, pgid);
+            flags |= POSIX_SPAWN_SETPGROUP;
+        }
+        posix_spawnattr_setflags(&attr, flags);
+        pid_t pid;
+        int err = posix_spawn(&pid, path, &fa, &attr, argv, environ);
+        if ((err == ENOENT || err == ENOTDIR) && cached && access(path, X_OK) == -1) {
+            // La ruta guardada ya no sirve: se descarta y se busca de nuevo
+            path_cache_forget(argv[0]);
+            path = resolve_command(argv[0], &cached);
+            err = path ? posix_spawn(&pid, path, &fa, &attr, argv, environ) : ENOENT;
+        }
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&fa);
+        close_redirs(rfds, nr);
+        if (err != 0) {
+            fprintf(stderr, "mishell: %s: %s\n", argv[0], strerror(err));
+            errno = err;
+            return -1;
+        }
+        trace_thread(pid, argv[0]);
+        return pid;
+    }
+
+    // El hijo no puede tocar la caché del padre: una ruta guardada obsoleta
+    // se descarta aquí, antes de bifurcar
+    if (!b && cached && access(path, X_OK) == -1) {
+        path_cache_forget(argv[0]);
+        path = resolve_command(argv[0], &cached);
+        if (!path) {
+            close_redirs(rfds, nr);
+            fprintf(stderr, "mishell: %s: %s\n", argv[0], strerror(ENOENT));
+            errno = ENOENT;
+            return -1;
+        }
+    }
+
+    // Lo que la shell tenga sin escribir no debe duplicarse en el hijo
+    fflush(stdout);
+    pid_t pid = spawn_cgroup_fd != -1 ? fork_into_cgroup(spawn_cgroup_fd) : fork();
+    if (pid == -1) {
+        int err = errno;
+        close_redirs(rfds, nr);
+        fprintf(stderr, "mishell: %s: %s\n", spawn_cgroup_fd != -1 ? "clone3" : "fork", strerror(err));
+        errno = err;
+        return -1;
+    }
+    if (pid == 0) {
+        if (pgid >= 0) setpgid(0, pgid);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &orig_sigmask, NULL);
+        if (in_fd != STDIN_FILENO) dup2(in_fd, STDIN_FILENO);
+        if (out_fd != STDOUT_FILENO) dup2(out_fd, STDOUT_FILENO);
+        if (err_fd != STDERR_FILENO) dup2(err_fd, STDERR_FILENO);
+        if (apply_redirs(redirs, rfds) == -1) _exit(1);
+        if (b) {
+            signal(SIGINT, SIG_DFL);
+            int code = builtin_call(b, argv);
+            fflush(stdout);
+            _exit(code);
+        }
+        execve(path, argv, environ);
+        // La ruta pudo desaparecer entre la comprobación y el exec: se
+        // recurre a la búsqueda completa
+        if ((errno == ENOENT || errno == ENOTDIR) && cached) execvp(argv[0], argv);
+        // Si exec retorna, hubo error
+        fprintf(stderr, "mishell: %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    close_redirs(rfds, nr);
+    // También en el padre, para que el grupo exista antes de lanzar la
+    // siguiente etapa o ceder la terminal
+    if (pgid >= 0) setpgid(pid, pgid == 0 ? pid : pgid);
+    trace_thread(pid, argv[0]);
+    return pid;
+}
+
+// Selecciona el backend por nombre ("fork" o "posix_spawn")
+int set_spawn_backend(const char *name) {
+    if (strcmp(name, "fork") == 0) spawn_backend = SPAWN_FORK;
+    else if (strcmp(name, "posix_spawn") == 0) spawn_backend = SPAWN_POSIX;
+    else return -1;
+    return 0;
+}
+
+// Descarta las notificaciones de SIGCHLD acumuladas en sigchld_fd
+void drain_sigchld(void) {
+    struct signalfd_siginfo si;
+    while (read(sigchld_fd, &si, sizeof(si)) == sizeof(si)) {}
+}
+
+// Etapa de una tubería en ejecución
+struct stage_prof {
+    pid_t pid;
+    struct timespec start, end;
+    struct rusage usage;
+    int status;
+    int done;
+    int stopped;                // señal que la detuvo (0 si corre)
+};
+
+double ts_diff(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec)/1e9;
+}
+
+// Recoge sin bloquear las etapas que ya terminaron, en cualquier orden, y
+// anota su hora de fin y sus recursos. Con keep_stopped una etapa detenida
+// queda marcada (control de trabajos); si no, se reanuda. Devuelve cuántas
+// siguen corriendo.
+int reap_stages(struct stage_prof *st, int n, int keep_stopped) {
+    int live = 0;
+    for (int i = 0; i < n; ++i) {
+        if (st[i].done) continue;
+        int status;
+        struct rusage ru;
+        pid_t w = wait4(st[i].pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru);
+        if (w == st[i].pid && WIFSTOPPED(status)) {
+            if (keep_stopped) st[i].stopped = WSTOPSIG(status);
+            else kill(st[i].pid, SIGCONT);
+        } else if (w == st[i].pid && WIFCONTINUED(status)) {
+            st[i].stopped = 0;
+        } else if (w == st[i].pid || (w == -1 && errno == ECHILD)) {
+            if (w == st[i].pid) { st[i].status = status; st[i].usage = ru; }
+            clock_gettime(CLOCK_MONOTONIC, &st[i].end);
+            st[i].done = 1;
+            trace_span("proceso", st[i].pid, &st[i].start, &st[i].end);
+            continue;
+        }
+        if (!st[i].stopped) live++;
+    }
+    return live;
+}
+
+// Cede la terminal al grupo pgid si la shell es quien la controla.
+// Devuelve 1 si lo hizo (y hay que recuperarla con take_terminal).
+int give_terminal(pid_t pgid) {
+    if (!isatty(STDIN_FILENO) || tcgetpgrp(STDIN_FILENO) != getpgrp()) return 0;
+    return tcsetpgrp(STDIN_FILENO, pgid) == 0;
+}
+
+// Recupera la terminal (SIGTTOU está bloqueada en la shell)
+void take_terminal(void) {
+    tcsetpgrp(STDIN_FILENO, getpgrp());
+}
+
+// Límite del sistema para F_SETPIPE_SZ sin privilegios
+long pipe_max_size(void) {
+    long max = 1 << 20;
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (f) {
+        if (fscanf(f, "%ld", &max) != 1) max = 1 << 20;
+        fclose(f);
+    }
+    return max;
+}
+
+// Fija la capacidad de las tuberías entre etapas: bytes con sufijo K o M
+// opcional, o "default". Se recorta a pipe-max-size. Devuelve -1 si no es válida.
+int set_pipe_size(const char *arg) {
+    if (strcmp(arg, "default") == 0) { pipe_size = 0; return 0; }
+    char *end;
+    long v = strtol(arg, &end, 10);
+    if (*end == 'K' || *end == 'k') { v <<= 10; end++; }
+    else if (*end == 'M' || *end == 'm') { v <<= 20; end++; }
+    if (*end != '\0' || end == arg || v <= 0) return -1;
+    long max = pipe_max_size();
+    if (v > max) {
+        fprintf(stderr, "mishell: pipesize: %ld excede pipe-max-size, se usa %ld\n", v, max);
+        v = max;
+    }
+    pipe_size = (int)v;
+    return 0;
+}
+
+// Aplica la capacidad configurada a una tubería recién creada. Si el kernel
+// la rechaza (p. ej. por el límite de páginas por usuario) queda la de siempre.
+void apply_pipe_size(int fd) {
+    if (pipe_size > 0) fcntl(fd, F_SETPIPE_SZ, pipe_size);
+}
+
+// Trabajo: tubería en segundo plano o detenida con Ctrl-Z. Las de primer
+// plano usan etapas en la pila y solo se copian aquí si se detienen.
+struct job {
+    int id;
+    pid_t pgid;
+    int n;                      // etapas lanzadas
+    int nstages;                // etapas pedidas
+    int stopped;                // ninguna etapa corre y alguna está detenida
+    int notified;               // ya se informó que se detuvo
+    char *cmd;                  // texto para jobs, fg y bg
+    struct stage_prof *st;
+    struct job *next;
+};
+static struct job *job_list = NULL;
+
+// Estado de espera del trabajo: el de su última etapa, o -1 si la tubería
+// no se pudo armar completa
+int job_status(const struct job *j) {
+    return j->n < j->nstages ? -1 : j->st[j->n - 1].status;
+}
+
+// Código de salida al estilo sh de un estado de espera
+int exit_code(int status) {
+    if (status == -1) return 1;
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status)) return 128 + WSTOPSIG(status);
+    return WEXITSTATUS(status);
+}
+
+// Actualiza el estado del trabajo sin bloquear. Devuelve cuántas etapas
+// siguen corriendo. Con tty, una etapa detenida por leer o escribir en la
+// terminal antes de recibirla se reanuda: solo Ctrl-Z la suspende.
+int job_update(struct job *j, int tty) {
+    int live = reap_stages(j->st, j->n, 1);
+    int stopped = 0;
+    for (int i = 0; i < j->n; ++i) {
+        if (j->st[i].done || !j->st[i].stopped) continue;
+        if (tty && (j->st[i].stopped == SIGTTIN || j->st[i].stopped == SIGTTOU)) {
+            j->st[i].stopped = 0;
+            kill(j->st[i].pid, SIGCONT);
+            live++;
+        } else {
+            stopped = 1;
+        }
+    }
+    j->stopped = live == 0 && stopped;
+    if (!j->stopped) j->notified = 0;
+    return live;
+}
+
+// Copia el trabajo a la tabla con el siguiente número libre. El texto se
+// arma con los argv porque la línea se reutiliza.
+struct job *job_add(const struct job *src, struct command *cmds) {
+    struct job *j = malloc(sizeof(*j));
+    if (!j) return NULL;
+    *j = *src;
+    j->st = malloc(sizeof(*j->st) * src->n);
+    size_t len = 1;
+    for (int i = 0; i < src->nstages; ++i)
+        for (int k = 0; cmds[i].argv[k]; ++k) len += strlen(cmds[i].argv[k]) + 3;
+    j->cmd = malloc(len);
+    if (!j->st || !j->cmd) {
+        free(j->st);
+        free(j->cmd);
+        free(j);
+        return NULL;
+    }
+    memcpy(j->st, src->st, sizeof(*j->st) * src->n);
+    char *p = j->cmd;
+    for (int i = 0; i < src->nstages; ++i) {
+        if (i > 0) p = stpcpy(p, " | ");
+        for (int k = 0; cmds[i].argv[k]; ++k) {
+            if (k > 0) *p++ = ' ';
+            p = stpcpy(p, cmds[i].argv[k]);
+        }
+    }
+    *p = '\0';
+
+    struct job **tail = &job_list;
+    int id = 0;
+    for (; *tail; tail = &(*tail)->next) id = (*tail)->id;
+    j->id = id + 1;
+    j->next = NULL;
+    *tail = j;
+    return j;
+}
+
+void job_free(struct job *j) {
+    for (struct job **pp = &job_list; *pp; pp = &(*pp)->next) {
+        if (*pp == j) { *pp = j->next; break; }
+    }
+    free(j->st);
+    free(j->cmd);
+    free(j);
+}
+
+// Muestra una línea de jobs: [n]+ Estado comando
+void print_job(const struct job *j, int live) {
+    char state[64];
+    if (live > 0) snprintf(state, sizeof(state), "Ejecutando");
+    else if (j->stopped) snprintf(state, sizeof(state), "Detenido");
+    else {
+        int status = job_status(j);
+        if (status == -1) snprintf(state, sizeof(state), "Fallido");
+        else if (WIFSIGNALED(status)) snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(status)));
+        else if (WEXITSTATUS(status) != 0) snprintf(state, sizeof(state), "Salida %d", WEXITSTATUS(status));
+        else snprintf(state, sizeof(state), "Hecho");
+    }
+    printf("[%d]%c  %-24s%s\n", j->id, j->next ? ' ' : '+', state, j->cmd);
+}
+
+// Antes de cada prompt: informa los trabajos que terminaron (y los saca de
+// la tabla) y los que se detuvieron desde el último aviso. Sin report solo
+// los recoge.
+void notify_jobs(int report) {
+    struct job *j = job_list;
+    while (j) {
+        struct job *next = j->next;
+        int live = job_update(j, 0);
+        if (live == 0 && !j->stopped) {
+            if (report) print_job(j, live);
+            job_free(j);
+        } else if (j->stopped && !j->notified) {
+            if (report) print_job(j, live);
+            j->notified = 1;
+        }
+        j = next;
+    }
+    fflush(stdout);
+}
+
+// Espera en primer plano hasta que el trabajo termine o se detenga, y
+// recupera la terminal si se le había cedido
+void wait_foreground(struct job *j, int tty) {
+    current_pgrp = j->pgid;
+    while (job_update(j, tty) > 0) {
+        // SIGCHLD despierta al poll y se recoge todo lo que haya terminado
+        struct pollfd pfd = { .fd = sigchld_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            for (int i = 0; i < j->n; ++i)
+                if (!j->st[i].done) waitpid(j->st[i].pid, &j->st[i].status, 0);
+            break;
+        }
+        drain_sigchld();
+    }
+    if (tty) take_terminal();
+    current_pgrp = 0;
+}
+
+// Ejecuta una tubería de n etapas ya parseadas. Todas las etapas van en un
+// grupo de procesos propio; en primer plano recibe la terminal y SIGINT y
+// las etapas se recogen a medida que terminan, sin esperar en orden. Con bg
+// el grupo pasa a la tabla de trabajos y se vuelve enseguida.
+int execute_pipeline(struct command *cmds, int n, int bg) {
+    int i;
+    int in_fd = STDIN_FILENO;
+    int nspawned = 0;
+    struct stage_prof st[MAX_COMMANDS];
+    pid_t pgid = 0;
+    int tty = 0;
+
+    // Sin terminal no hay control de trabajos: como en sh, un trabajo en
+    // segundo plano no lee la entrada de la shell
+    if (bg && !isatty(STDIN_FILENO)) {
+        in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (in_fd == -1) in_fd = STDIN_FILENO;
+    }
+
+    for (i = 0; i < n; ++i) {
+        int pipefd[2] = {-1, -1};
+        if (i < n-1) {
+            trace_begin("tubería", NULL);
+            if (pipe2(pipefd, O_CLOEXEC) == -1) {
+                perror("pipe");
+                trace_end("tubería");
+                break;
+            }
+            apply_pipe_size(pipefd[0]);
+            trace_end("tubería");
+        }
+
+        memset(&st[i], 0, sizeof(st[i]));
+        nspawned++;
+        trace_begin("lanzar", cmds[i].argv[0]);
+        clock_gettime(CLOCK_MONOTONIC, &st[i].start);
+        st[i].pid = spawn_command(cmds[i].argv, cmds[i].redirs, in_fd, i < n-1 ? pipefd[1] : STDOUT_FILENO, STDERR_FILENO, pgid);
+        stat_add(ST_SPAWN, now_ns() - (st[i].start.tv_sec * 1000000000LL + st[i].start.tv_nsec));
+        trace_end("lanzar");
+        if (st[i].pid == -1) {
+            st[i].status = 127 << 8;
+            st[i].done = 1;
+        } else if (pgid == 0) {
+            // La primera etapa lanzada es líder del grupo
+            pgid = st[i].pid;
+            if (!bg) {
+                current_pgrp = pgid;
+                tty = give_terminal(pgid);
+            }
+        }
+
+        if (in_fd != STDIN_FILENO) close(in_fd);
+        in_fd = STDIN_FILENO;
+        if (i < n-1) {
+            close(pipefd[1]);
+            in_fd = pipefd[0];
+        }
+    }
+    if (in_fd != STDIN_FILENO) close(in_fd);
+
+    struct job fg = { .pgid = pgid, .n = nspawned, .nstages = n, .st = st };
+    if (bg) {
+        if (pgid == 0) return job_status(&fg);
+        struct job *j = job_add(&fg, cmds);
+        if (!j) {
+            perror("mishell: trabajo");
+            return -1;
+        }
+        if (interactive) {
+            printf("[%d] %d\n", j->id, (int)pgid);
+            fflush(stdout);
+        }
+        return 0;
+    }
+
+    trace_begin("esperar", NULL);
+    long long t0 = now_ns();
+    wait_foreground(&fg, tty);
+    stat_add(ST_WAIT, now_ns() - t0);
+    trace_end("esperar");
+    if (fg.stopped) {
+        // Ctrl-Z: la tubería pasa a la tabla de trabajos
+        struct job *j = job_add(&fg, cmds);
+        if (j) {
+            printf("\n");
+            print_job(j, 0);
+            fflush(stdout);
+            j->notified = 1;
+        }
+        for (i = 0; i < nspawned; ++i)
+            if (st[i].stopped) return (128 + st[i].stopped) << 8;
+    }
+    return job_status(&fg);
+}
+
+// Busca un trabajo por %n, %% o %+ (el más reciente) o por pid. Sin spec
+// devuelve el más reciente que cumpla stopped_only.
+struct job *find_job(const char *who, const char *spec, int stopped_only) {
+    struct job *found = NULL;
+    if (!spec || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        for (struct job *j = job_list; j; j = j->next)
+            if (!stopped_only || j->stopped) found = j;
+        if (!found) fprintf(stderr, "mishell: %s: no hay trabajo actual\n", who);
+        return found;
+    }
+    char *end;
+    long v = strtol(spec[0] == '%' ? spec + 1 : spec, &end, 10);
+    if (*end == '\0' && end != spec) {
+        for (struct job *j = job_list; j && !found; j = j->next) {
+            if (spec[0] == '%') {
+                if (j->id == v) found = j;
+                continue;
+            }
+            for (int i = 0; i < j->n; ++i)
+                if (j->st[i].pid == v) found = j;
+        }
+    }
+    if (!found) fprintf(stderr, "mishell: %s: %s: no existe ese trabajo\n", who, spec);
+    return found;
+}
+
+// jobs: lista la tabla; los terminados se informan por última vez
+int builtin_jobs(char **argv) {
+    (void)argv;
+    struct job *j = job_list;
+    while (j) {
+        struct job *next = j->next;
+        int live = job_update(j, 0);
+        print_job(j, live);
+        if (live == 0 && !j->stopped) job_free(j);
+        else if (j->stopped) j->notified = 1;
+        j = next;
+    }
+    return 0;
+}
+
+// fg [%n]: reanuda el trabajo en primer plano con la terminal
+int builtin_fg(char **argv) {
+    struct job *j = find_job("fg", argv[1], 0);
+    if (!j) return 1;
+    printf("%s\n", j->cmd);
+    fflush(stdout);
+    int tty = give_terminal(j->pgid);
+    for (int i = 0; i < j->n; ++i) j->st[i].stopped = 0;
+    kill(-j->pgid, SIGCONT);
+    wait_foreground(j, tty);
+    if (j->stopped) {
+        printf("\n");
+        print_job(j, 0);
+        j->notified = 1;
+        return 128 + SIGTSTP;
+    }
+    int status = job_status(j);
+    job_free(j);
+    return exit_code(status);
+}
+
+// bg [%n]: reanuda en segundo plano un trabajo detenido
+int builtin_bg(char **argv) {
+    struct job *j = find_job("bg", argv[1], argv[1] == NULL);
+    if (!j) return 1;
+    for (int i = 0; i < j->n; ++i) j->st[i].stopped = 0;
+    j->stopped = 0;
+    j->notified = 0;
+    kill(-j->pgid, SIGCONT);
+    printf("[%d] %s &\n", j->id, j->cmd);
+    return 0;
+}
+
+// wait [%n]: espera a un trabajo, o a todos los que corren, y los saca de
+// la tabla. Los detenidos no se esperan. Ctrl-C interrumpe la espera.
+int builtin_wait(char **argv) {
+    struct job *target = NULL;
+    if (argv[1] && !(target = find_job("wait", argv[1], 0))) return 127;
+    got_sigint = 0;
+    while (1) {
+        int running = 0;
+        struct job *j = job_list;
+        while (j) {
+            struct job *next = j->next;
+            int live = job_update(j, 0);
+            if (live == 0 && !j->stopped && !target) job_free(j);
+            else if (!target || j == target) running += live;
+            j = next;
+        }
+        if (running == 0 || got_sigint) break;
+        struct pollfd pfd = { .fd = sigchld_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+        drain_sigchld();
+    }
+    if (got_sigint) return 128 + SIGINT;
+    if (!target) return 0;
+    if (target->stopped) return 128 + SIGTSTP;
+    int status = job_status(target);
+    job_free(target);
+    return exit_code(status);
+}
+
+// Salida de un hijo volcada a un archivo con splice (sin pasar por espacio
+// de usuario) y, opcionalmente, replicada con tee hacia otro descriptor
+struct out_stream {
+    int in_fd;        // extremo de lectura de la tubería del hijo (O_NONBLOCK)
+    int out_fd;       // archivo destino
+    int mirror_fd;    // -1 o descriptor donde replicar (p. ej. la terminal)
+    int tee_fd[2];    // tubería auxiliar para tee()
+    int no_splice;    // el destino no admite splice: copiar con read/write
+};
+
+// Copia exactamente len bytes de una tubería a fd; usa splice y, si el destino
+// no lo admite (p. ej. algunas terminales), read/write
+int pipe_copy(int pipe_fd, int fd, size_t len, int *no_splice) {
+    char buf[65536];
+    while (len > 0) {
+        ssize_t n;
+        if (!*no_splice) {
+            n = splice(pipe_fd, NULL, fd, NULL, len, SPLICE_F_MOVE);
+            if (n == -1 && errno == EINVAL) { *no_splice = 1; continue; }
+        } else {
+            n = read(pipe_fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+            if (n > 0 && write(fd, buf, n) != n) return -1;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Mueve hacia el destino lo que haya disponible en la tubería del hijo.
+// Devuelve 0 al llegar a EOF, 1 si puede venir más, -1 en error.
+int stream_pump(struct out_stream *st) {
+    int mirror_no_splice = 0;
+    while (1) {
+        ssize_t n;
+        if (st->mirror_fd != -1) {
+            // tee duplica sin consumir; luego se mueve lo mismo al archivo
+            n = tee(st->in_fd, st->tee_fd[1], 1 << 16, SPLICE_F_NONBLOCK);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                return errno == EAGAIN ? 1 : -1;
+            }
+            if (n == 0) return 0;
+            if (pipe_copy(st->tee_fd[0], st->mirror_fd, n, &mirror_no_splice) == -1) return -1;
+            if (pipe_copy(st->in_fd, st->out_fd, n, &st->no_splice) == -1) return -1;
+            continue;
+        }
+        if (!st->no_splice) {
+            n = splice(st->in_fd, NULL, st->out_fd, NULL, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == -1 && errno == EINVAL) { st->no_splice = 1; continue; }
+        } else {
+            char buf[65536];
+            n = read(st->in_fd, buf, sizeof(buf));
+            if (n > 0 && write(st->out_fd, buf, n) != n) return -1;
+        }
+        if (n == 0) return 0;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN ? 1 : -1;
+        }
+    }
+}
+
+// Crea un timerfd que vence a los timeout segundos (admite fracciones).
+// Devuelve -1 si timeout <= 0 o si no se pudo crear.
+int timeout_fd(double timeout) {
+    if (timeout <= 0) return -1;
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (tfd == -1) { perror("timerfd_create"); return -1; }
+    struct itimerspec its = {0};
+    its.it_value.tv_sec = (time_t)timeout;
+    its.it_value.tv_nsec = (long)((timeout - (time_t)timeout) * 1e9);
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+    timerfd_settime(tfd, 0, &its, NULL);
+    return tfd;
+}
+
+// Muestreo periódico del árbol de un comando perfilado (miprof sample).
+// Cada proceso seguido conserva abiertos sus archivos de /proc y se relee
+// con pread: una muestra cuesta dos lecturas por proceso (stat trae también
+// el RSS que daría statm). Si aun así el muestreo pasa del 1% de una CPU,
+// el intervalo se duplica.
+#define SAMPLE_MAX_PROCS 256
+struct sample_proc {
+    pid_t pid;
+    int stat_fd, io_fd, children_fd;
+    unsigned long long ticks;   // utime + stime de la muestra anterior
+    long long rchar, wchar;
+};
+
+// Una muestra; CPU y E/S son acumulados del árbol desde el inicio
+struct sample {
+    double t;
+    double cpu_sec;
+    long rss_kb;
+    long long rchar, wchar;
+    int nprocs, nthreads;
+};
+
+struct sampler {
+    double interval;            // segundos
+    double asked;               // intervalo pedido (interval crece si sale caro)
+    const char *out_file;       // serie a archivo (NULL = a pantalla tras el resumen)
+    int tfd;
+    struct timespec start;
+    struct sample_proc procs[SAMPLE_MAX_PROCS];
+    int nprocs;
+    int cg_procs_fd;            // cgroup.procs de la ejecución (-1 = sin cgroup)
+    int use_children;           // el kernel tiene /proc/<pid>/task/<pid>/children
+    int scan_every, ticks;      // sin lo anterior, recorrido de /proc cada scan_every muestras
+    double cpu_sec;
+    long long rchar, wchar;
+    struct sample *samples;
+    int n, cap;
+    double self_sec;            // CPU que gastó la shell muestreando
+    double window_t, window_self; // inicio de la ventana de presupuesto
+};
+
+int sampler_find(struct sampler *s, pid_t pid) {
+    for (int i = 0; i < s->nprocs; ++i) if (s->procs[i].pid == pid) return i;
+    return -1;
+}
+
+// Empieza a seguir pid; stat_fd puede venir ya abierto (recorrido de /proc)
+void sampler_add(struct sampler *s, pid_t pid, int stat_fd) {
+    if (s->nprocs == SAMPLE_MAX_PROCS || sampler_find(s, pid) != -1) {
+        if (stat_fd != -1) close(stat_fd);
+        return;
+    }
+    char path[64];
+    struct sample_proc *p = &s->procs[s->nprocs];
+    p->pid = pid;
+    p->ticks = 0;
+    p->rchar = p->wchar = 0;
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    p->stat_fd = stat_fd != -1 ? stat_fd : open(path, O_RDONLY | O_CLOEXEC);
+    if (p->stat_fd == -1) return;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    p->io_fd = open(path, O_RDONLY | O_CLOEXEC);
+    p->children_fd = -1;
+    if (s->use_children) {
+        snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)pid, (int)pid);
+        p->children_fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    s->nprocs++;
+}
+
+void sampler_drop(struct sampler *s, int i) {
+    struct sample_proc *p = &s->procs[i];
+    close(p->stat_fd);
+    if (p->io_fd != -1) close(p->io_fd);
+    if (p->children_fd != -1) close(p->children_fd);
+    *p = s->procs[--s->nprocs];
+}
+
+void sampler_add_list(struct sampler *s, char *list) {
+    for (char *p = list; *p; ) {
+        char *end;
+        long pid = strtol(p, &end, 10);
+        if (end == p) break;
+        if (pid > 0) sampler_add(s, pid, -1);
+        p = end;
+    }
+}
+
+// Incorpora los procesos nuevos del árbol: con cgroup basta cgroup.procs;
+// si no, los archivos children de cada proceso o, en kernels sin ellos, un
+// recorrido de /proc buscando hijos de los ya seguidos (más caro, por eso
+// espaciado)
+void sampler_discover(struct sampler *s) {
+    char buf[4096];
+    if (s->cg_procs_fd != -1) {
+        ssize_t n = pread(s->cg_procs_fd, buf, sizeof(buf) - 1, 0);
+        buf[n > 0 ? n : 0] = '\0';
+        sampler_add_list(s, buf);
+        return;
+    }
+    if (s->use_children) {
+        for (int i = 0; i < s->nprocs; ++i) {
+            if (s->procs[i].children_fd == -1) continue;
+            ssize_t n = pread(s->procs[i].children_fd, buf, sizeof(buf) - 1, 0);
+            buf[n > 0 ? n : 0] = '\0';
+            sampler_add_list(s, buf);
+        }
+        return;
+    }
+    if (s->ticks++ % s->scan_every != 0) return;
+    DIR *d = opendir("/proc");
+    struct dirent *e;
+    while (d && (e = readdir(d))) {
+        char *end;
+        long pid = strtol(e->d_name, &end, 10);
+        if (*end != '\0' || pid <= 0 || sampler_find(s, pid) != -1) continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) continue;
+        ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+        buf[n > 0 ? n : 0] = '\0';
+        char *rp = strrchr(buf, ')');
+        int ppid = 0;
+        if (rp && sscanf(rp + 2, "%*c %d", &ppid) == 1 && sampler_find(s, ppid) != -1) sampler_add(s, pid, fd);
+        else close(fd);
+    }
+    if (d) closedir(d);
+}
+
+void sampler_arm(struct sampler *s, double interval) {
+    s->interval = interval;
+    struct itimerspec its;
+    its.it_value.tv_sec = (time_t)interval;
+    its.it_value.tv_nsec = (long)((interval - (time_t)interval) * 1e9);
+    its.it_interval = its.it_value;
+    timerfd_settime(s->tfd, 0, &its, NULL);
+}
+
+// Toma una muestra. La CPU y la E/S se suman por diferencias entre muestras
+// de cada proceso vivo: así no se cuenta dos veces lo de un hijo que su
+// padre recoge (y pasa a cutime), a costa de perder su último intervalo.
+void sampler_tick(struct sampler *s) {
+    struct timespec c0, c1, now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c0);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    sampler_discover(s);
+
+    static long clk_tck = 0, page_kb = 0;
+    if (!clk_tck) { clk_tck = sysconf(_SC_CLK_TCK); page_kb = sysconf(_SC_PAGESIZE) / 1024; }
+    struct sample smp = { .t = ts_diff(&s->start, &now) };
+    char buf[1024];
+    for (int i = 0; i < s->nprocs; ) {
+        struct sample_proc *p = &s->procs[i];
+        ssize_t n = pread(p->stat_fd, buf, sizeof(buf) - 1, 0);
+        buf[n > 0 ? n : 0] = '\0';
+        char *rp = n > 0 ? strrchr(buf, ')') : NULL;
+        unsigned long long ut, st;
+        int threads;
+        long rss;
+        // Campos 14-15 (utime, stime), 20 (hilos) y 24 (RSS en páginas)
+        if (!rp || sscanf(rp + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %d"
+                " %*d %*u %*u %ld", &ut, &st, &threads, &rss) != 4) {
+            sampler_drop(s, i);
+            continue;
+        }
+        s->cpu_sec += (double)(ut + st - p->ticks) / clk_tck;
+        p->ticks = ut + st;
+        smp.rss_kb += rss * page_kb;
+        long long rc, wc;
+        if (p->io_fd != -1 && (n = pread(p->io_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+            buf[n] = '\0';
+            if (sscanf(buf, "rchar: %lld wchar: %lld", &rc, &wc) == 2) {
+                s->rchar += rc - p->rchar;
+                s->wchar += wc - p->wchar;
+                p->rchar = rc;
+                p->wchar = wc;
+            }
+        }
+        smp.nprocs++;
+        smp.nthreads += threads;
+        ++i;
+    }
+    smp.cpu_sec = s->cpu_sec;
+    smp.rchar = s->rchar;
+    smp.wchar = s->wchar;
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 256;
+        s->samples = realloc(s->samples, sizeof(struct sample) * s->cap);
+    }
+    s->samples[s->n++] = smp;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c1);
+    s->self_sec += ts_diff(&c0, &c1);
+    // El presupuesto se revisa por ventanas de un segundo (que incluyen un
+    // recorrido de /proc)
+    if (smp.t - s->window_t >= 1) {
+        if (s->self_sec - s->window_self > 0.01 * (smp.t - s->window_t) && s->tfd != -1)
+            sampler_arm(s, s->interval * 2);
+        s->window_t = smp.t;
+        s->window_self = s->self_sec;
+    }
+}
+
+// Arma el timerfd periódico y toma la muestra inicial del hijo pid
+void sampler_start(struct sampler *s, pid_t pid) {
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)pid, (int)pid);
+    s->use_children = access(path, R_OK) == 0;
+    s->cg_procs_fd = spawn_cgroup_fd != -1 ? openat(spawn_cgroup_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC) : -1;
+    s->asked = s->interval;
+    s->scan_every = s->interval < 1 ? (int)(1 / s->interval) : 1;
+    sampler_add(s, pid, -1);
+    sampler_tick(s);
+
+    s->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (s->tfd == -1) { perror("timerfd_create"); return; }
+    sampler_arm(s, s->interval);
+}
+
+void sampler_stop(struct sampler *s) {
+    if (s->tfd != -1) close(s->tfd);
+    s->tfd = -1;
+    if (s->cg_procs_fd != -1) close(s->cg_procs_fd);
+    s->cg_procs_fd = -1;
+    while (s->nprocs > 0) sampler_drop(s, 0);
+}
+
+// Espera a pid sin sondeo: duerme en poll sobre sigchld_fd y, si timeout > 0,
+// sobre un timerfd que vence a los timeout segundos (admite fracciones).
+// Al vencer mata al hijo con SIGKILL. El hijo se recoge con wait4, así que
+// ru queda con los recursos de ese hijo (y sus descendientes ya recogidos),
+// no con el acumulado de RUSAGE_CHILDREN. Si st no es NULL, mientras tanto
+// se vuelca la salida del hijo y, si smp no es NULL, se muestrea su árbol.
+// Devuelve 1 si se agotó el tiempo.
+int wait_child_timeout(pid_t pid, int *status, struct rusage *ru, double timeout, struct out_stream *st,
+                       struct sampler *smp) {
+    int tfd = timeout_fd(timeout);
+    if (smp) sampler_start(smp, pid);
+
+    int timed_out = 0, check = 1;
+    while (1) {
+        // Se consulta antes de dormir: un SIGCHLD que llegue después queda
+        // pendiente en sigchld_fd y despierta al poll. Si solo despertó el
+        // muestreo no hace falta volver a preguntar.
+        if (check) {
+            pid_t w = wait4(pid, status, WNOHANG, ru);
+            if (w == pid) break;
+            if (w == -1) { if (errno == EINTR) continue; perror("wait4"); break; }
+        }
+        check = 1;
+
+        // poll ignora las entradas con fd negativo
+        struct pollfd pfd[4] = {
+            { .fd = sigchld_fd, .events = POLLIN },
+            { .fd = tfd, .events = POLLIN },
+            { .fd = st ? st->in_fd : -1, .events = POLLIN },
+            { .fd = smp ? smp->tfd : -1, .events = POLLIN },
+        };
+        if (poll(pfd, 4, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            wait4(pid, status, 0, ru);
+            break;
+        }
+        if (pfd[0].revents & POLLIN) drain_sigchld();
+        if (pfd[3].revents & POLLIN) {
+            // Si la shell se atrasó, las expiraciones perdidas no se recuperan
+            unsigned long long exp;
+            if (read(smp->tfd, &exp, sizeof(exp)) == sizeof(exp)) sampler_tick(smp);
+            check = (pfd[0].revents | pfd[1].revents | pfd[2].revents) != 0;
+        }
+        if (pfd[2].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (stream_pump(st) != 1) {
+                close(st->in_fd);
+                st->in_fd = -1;
+            }
+        }
+        if (tfd != -1 && (pfd[1].revents & POLLIN)) {
+            kill(pid, SIGKILL);
+            wait4(pid, status, 0, ru);
+            timed_out = 1;
+            break;
+        }
+    }
+    if (tfd != -1) close(tfd);
+    if (smp) sampler_stop(smp);
+    return timed_out;
+}
+
+// Formato de los registros de métricas de miprof
+enum metrics_format { FMT_TEXT, FMT_JSON, FMT_CSV };
+
+// Opciones de una ejecución de miprof
+struct miprof_opts {
+    const char *save_file; // ejecsave: archivo destino (NULL = mostrar en pantalla)
+    int mirror;            // ejecsave: replicar además la salida en la terminal
+    double timeout;        // maxtiempo: segundos (0 = sin límite)
+    int quiet;             // no imprimir el resumen (lo usa quien llama)
+    int discard_output;    // enviar la salida estándar del hijo a /dev/null
+    struct redir *redirs;  // redirecciones del comando perfilado
+    enum metrics_format format; // registro estructurado por ejecución (FMT_TEXT = ninguno)
+    int metrics_fd;        // destino de los registros (-1 = salida estándar, sin resumen)
+    int csv_header;        // ya se escribió la cabecera CSV
+    struct sampler *sampler; // sample: muestreo mientras corre (NULL = ninguno)
+    const char *cgroup;    // padre del cgroup por ejecución ("auto" = el de la shell; NULL = sin cgroup)
+    const char *memory_max; // límites del cgroup (NULL = sin límite)
+    const char *cpu_max;
+};
+
+// Mediciones de una ejecución
+struct prof_result {
+    double real_sec, usr_sec, sys_sec;
+    long maxrss;           // en Linux: kilobytes
+    struct rusage usage;
+    struct timespec start_wall; // inicio según CLOCK_REALTIME
+    pid_t pid;
+    int status;
+    int timed_out;
+};
+
+// Escribe s como cadena JSON (entre comillas y con escapes)
+void json_put_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+// Escribe s como campo CSV; se entrecomilla solo si hace falta
+void csv_put_field(FILE *f, const char *s) {
+    if (!strpbrk(s, ",\"\r\n")) { fputs(s, f); return; }
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '"') fputc('"', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// Emite un registro de métricas (una línea JSON o CSV) en fd. El registro
+// se arma en memoria y se escribe con un solo write, así varias shells pueden
+// añadir al mismo archivo sin mezclar líneas.
+void write_metrics_record(int fd, struct miprof_opts *opts, char **argv, const struct prof_result *r) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&buf, &len);
+    if (!f) { perror("open_memstream"); return; }
+
+    char start[64];
+    struct tm tm;
+    gmtime_r(&r->start_wall.tv_sec, &tm);
+    size_t sl = strftime(start, sizeof(start), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(start + sl, sizeof(start) - sl, ".%06ldZ", r->start_wall.tv_nsec / 1000);
+
+    const struct rusage *u = &r->usage;
+    int exited = WIFEXITED(r->status), signaled = WIFSIGNALED(r->status);
+    if (opts->format == FMT_JSON) {
+        fputs("{\"command\":", f);
+        json_put_string(f, argv[0]);
+        fputs(",\"argv\":[", f);
+        for (int i = 0; argv[i]; ++i) {
+            if (i) fputc(',', f);
+            json_put_string(f, argv[i]);
+        }
+        fprintf(f, "],\"pid\":%d,\"start\":\"%s\",\"real_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f,"
+            "\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,"
+            "\"inblock\":%ld,\"oublock\":%ld,",
+            (int)r->pid, start, r->real_sec, r->usr_sec, r->sys_sec,
+            r->maxrss, u->ru_minflt, u->ru_majflt, u->ru_nvcsw, u->ru_nivcsw, u->ru_inblock, u->ru_oublock);
+        if (exited) fprintf(f, "\"exit_code\":%d,\"signal\":null,", WEXITSTATUS(r->status));
+        else if (signaled) fprintf(f, "\"exit_code\":null,\"signal\":%d,", WTERMSIG(r->status));
+        else fputs("\"exit_code\":null,\"signal\":null,", f);
+        fprintf(f, "\"timed_out\":%s}\n", r->timed_out ? "true" : "false");
+    } else {
+        // La cabecera va una vez por invocación, o nunca si el archivo ya tiene datos
+        if (!opts->csv_header) {
+            struct stat st;
+            if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+                fputs("command,argv,pid,start,real_s,user_s,sys_s,maxrss_kb,minflt,majflt,"
+                      "nvcsw,nivcsw,inblock,oublock,exit_code,signal,timed_out\n", f);
+            opts->csv_header = 1;
+        }
+        csv_put_field(f, argv[0]);
+        fputc(',', f);
+        // argv se une con espacios en un solo campo
+        char *joined = NULL;
+        size_t jlen = 0;
+        FILE *j = open_memstream(&joined, &jlen);
+        for (int i = 0; argv[i]; ++i) fprintf(j, i ? " %s" : "%s", argv[i]);
+        fclose(j);
+        csv_put_field(f, joined);
+        free(joined);
+        fprintf(f, ",%d,%s,%.6f,%.6f,%.6f,%ld,%ld,%ld,%ld,%ld,%ld,%ld,",
+            (int)r->pid, start, r->real_sec, r->usr_sec, r->sys_sec,
+            r->maxrss, u->ru_minflt, u->ru_majflt, u->ru_nvcsw, u->ru_nivcsw, u->ru_inblock, u->ru_oublock);
+        if (exited) fprintf(f, "%d,", WEXITSTATUS(r->status));
+        else fputc(',', f);
+        if (signaled) fprintf(f, "%d,", WTERMSIG(r->status));
+        else fputc(',', f);
+        fprintf(f, "%d\n", r->timed_out);
+    }
+    fclose(f);
+
+    if (write(fd, buf, len) != (ssize_t)len) perror("miprof: métricas");
+    free(buf);
+}
+
+// Cgroup v2 transitorio de una ejecución de miprof (--cgroup)
+struct cg_run {
+    int parent_fd, fd;
+    char name[64];
+};
+
+// Contabilidad del cgroup: cubre a todos los procesos que pasaron por él,
+// también a los nietos que wait4 nunca ve. -1 = el controlador no está.
+struct cg_stats {
+    int valid;
+    double usr_sec, sys_sec;
+    long long throttled, throttled_usec;  // veces y tiempo frenado por cpu.max
+    long long mem_peak;                   // bytes
+    long long oom_kills;
+    long long pids_peak;
+    long long rbytes, wbytes;
+    int leftover;                         // procesos vivos al terminar el comando
+};
+
+// Directorio del cgroup v2 de la shell: punto de montaje de cgroup2 (según
+// /proc/self/mountinfo) más la ruta de la línea "0::" de /proc/self/cgroup
+char *cgroup_self_path(void) {
+    char *line = NULL, *path = NULL;
+    size_t cap = 0;
+    char root[4096] = "", point[4096] = "";
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+    while (f && !point[0] && getline(&line, &cap, f) != -1) {
+        // id padre mayor:menor raíz punto opciones [etiquetas] - tipo origen opciones
+        char *sep = strstr(line, " - ");
+        if (!sep || strncmp(sep + 3, "cgroup2 ", 8) != 0) continue;
+        if (sscanf(line, "%*s %*s %*s %4095s %4095s", root, point) != 2) point[0] = '\0';
+    }
+    if (f) fclose(f);
+    f = point[0] ? fopen("/proc/self/cgroup", "r") : NULL;
+    while (f && !path && getline(&line, &cap, f) != -1) {
+        if (strncmp(line, "0::", 3) != 0) continue;
+        char *rel = line + 3;
+        rel[strcspn(rel, "\n")] = '\0';
+        // La ruta es relativa a la raíz del montaje
+        size_t rl = strlen(root);
+        if (strcmp(root, "/") != 0 && strncmp(rel, root, rl) == 0) rel += rl;
+        if (asprintf(&path, "%s%s", point, rel) == -1) path = NULL;
+    }
+    if (f) fclose(f);
+    free(line);
+    return path;
+}
+
+// Lee un archivo de interfaz del cgroup en buf (terminado en '\0')
+ssize_t cgroup_read(int dirfd, const char *file, char *buf, size_t size) {
+    int fd = openat(dirfd, file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    buf[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+int cgroup_write(int dirfd, const char *file, const char *val) {
+    int fd = openat(dirfd, file, O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, val, strlen(val)) == -1) {
+        if (errno == ENOENT) fprintf(stderr, "miprof: %s: el cgroup padre no delega ese controlador\n", file);
+        else fprintf(stderr, "miprof: %s: %s\n", file, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+// Valor de "clave N" en un archivo con formato de claves planas (cpu.stat,
+// memory.events)
+long long cgroup_key(const char *buf, const char *key) {
+    size_t kl = strlen(key);
+    for (const char *p = buf; p && *p; p = strchr(p, '\n'), p = p ? p + 1 : NULL)
+        if (strncmp(p, key, kl) == 0 && p[kl] == ' ') return atoll(p + kl + 1);
+    return -1;
+}
+
+void cgroup_end(struct cg_run *cg, struct cg_stats *s);
+
+// Crea el cgroup de una ejecución bajo opts->cgroup ("auto" = el de la
+// shell), le aplica los límites pedidos y hace que spawn_command meta ahí a
+// los hijos siguientes. Los controladores que el padre no pueda delegar (por
+// tener procesos propios, por ejemplo) solo faltan en el reporte.
+int cgroup_begin(struct miprof_opts *opts, struct cg_run *cg) {
+    cg->parent_fd = cg->fd = -1;
+    if (!opts->cgroup) return 0;
+    char *path = strcmp(opts->cgroup, "auto") == 0 ? cgroup_self_path() : strdup(opts->cgroup);
+    if (!path) {
+        fprintf(stderr, "miprof: no se encontró el cgroup v2 de la shell\n");
+        return -1;
+    }
+    cg->parent_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cg->parent_fd == -1) {
+        fprintf(stderr, "miprof: %s: %s\n", path, strerror(errno));
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    static const char *controllers[] = { "+cpu", "+memory", "+io", "+pids" };
+    int sfd = openat(cg->parent_fd, "cgroup.subtree_control", O_WRONLY | O_CLOEXEC);
+    for (int i = 0; sfd != -1 && i < 4; ++i)
+        if (write(sfd, controllers[i], strlen(controllers[i])) == -1) {}
+    if (sfd != -1) close(sfd);
+
+    static unsigned seq = 0;
+    snprintf(cg->name, sizeof(cg->name), "mishell-%d-%u", (int)getpid(), seq++);
+    if (mkdirat(cg->parent_fd, cg->name, 0755) == -1) {
+        fprintf(stderr, "miprof: cgroup %s: %s\n", cg->name, strerror(errno));
+        close(cg->parent_fd);
+        cg->parent_fd = -1;
+        return -1;
+    }
+    cg->fd = openat(cg->parent_fd, cg->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    // cpu.max acepta "cuota periodo" o un porcentaje de una CPU
+    char cpu_max[64];
+    const char *cpu = opts->cpu_max;
+    size_t cl = cpu ? strlen(cpu) : 0;
+    if (cl > 1 && cpu[cl-1] == '%') {
+        snprintf(cpu_max, sizeof(cpu_max), "%ld 100000", (long)(atof(cpu) * 1000));
+        cpu = cpu_max;
+    }
+    if (cg->fd == -1 || (opts->memory_max && cgroup_write(cg->fd, "memory.max", opts->memory_max) == -1)
+        || (cpu && cgroup_write(cg->fd, "cpu.max", cpu) == -1)) {
+        cgroup_end(cg, NULL);
+        return -1;
+    }
+    spawn_cgroup_fd = cg->fd;
+    return 0;
+}
+
+// Toma la contabilidad del cgroup, mata lo que siga vivo dentro (demonios,
+// trabajadores huérfanos) y lo borra
+void cgroup_end(struct cg_run *cg, struct cg_stats *s) {
+    if (cg->parent_fd == -1) return;
+    spawn_cgroup_fd = -1;
+    char buf[4096];
+    if (s && cg->fd != -1) {
+        *s = (struct cg_stats){ .valid = 1, .throttled = -1, .throttled_usec = -1, .mem_peak = -1,
+            .oom_kills = -1, .pids_peak = -1, .rbytes = -1, .wbytes = -1 };
+        if (cgroup_read(cg->fd, "cpu.stat", buf, sizeof(buf)) > 0) {
+            s->usr_sec = cgroup_key(buf, "user_usec") / 1e6;
+            s->sys_sec = cgroup_key(buf, "system_usec") / 1e6;
+            s->throttled = cgroup_key(buf, "nr_throttled");
+            s->throttled_usec = cgroup_key(buf, "throttled_usec");
+        }
+        if (cgroup_read(cg->fd, "memory.peak", buf, sizeof(buf)) > 0) s->mem_peak = atoll(buf);
+        if (cgroup_read(cg->fd, "memory.events", buf, sizeof(buf)) > 0) s->oom_kills = cgroup_key(buf, "oom_kill");
+        if (cgroup_read(cg->fd, "pids.peak", buf, sizeof(buf)) > 0) s->pids_peak = atoll(buf);
+        // io.stat: una línea por dispositivo, "maj:min rbytes=N wbytes=N ..."
+        if (cgroup_read(cg->fd, "io.stat", buf, sizeof(buf)) >= 0) {
+            s->rbytes = s->wbytes = 0;
+            for (char *p = buf; (p = strchr(p, ' ')); ++p) {
+                if (strncmp(p, " rbytes=", 8) == 0) s->rbytes += atoll(p + 8);
+                else if (strncmp(p, " wbytes=", 8) == 0) s->wbytes += atoll(p + 8);
+            }
+        }
+    }
+
+    int left = 0;
+    if (cg->fd != -1 && cgroup_read(cg->fd, "cgroup.procs", buf, sizeof(buf)) > 0) {
+        for (char *p = buf; *p; ++p) if (*p == '\n') left++;
+        // cgroup.kill (5.14) mata a todo el árbol sin carreras con fork
+        int kfd = openat(cg->fd, "cgroup.kill", O_WRONLY | O_CLOEXEC);
+        if (kfd == -1 || write(kfd, "1", 1) != 1)
+            for (char *p = buf; *p; p = strchr(p, '\n') + 1) kill(atoi(p), SIGKILL);
+        if (kfd != -1) close(kfd);
+    }
+    if (s) s->leftover = left;
+    if (cg->fd != -1) close(cg->fd);
+
+    // El borrado falla con EBUSY hasta que los procesos muertos salen del cgroup
+    struct timespec ms = { 0, 1000000 };
+    int tries = 0;
+    while (unlinkat(cg->parent_fd, cg->name, AT_REMOVEDIR) == -1 && errno == EBUSY && ++tries < 1000)
+        nanosleep(&ms, NULL);
+    if (tries == 1000) fprintf(stderr, "miprof: no se pudo borrar el cgroup %s\n", cg->name);
+    close(cg->parent_fd);
+    cg->parent_fd = cg->fd = -1;
+}
+
+// Agrega al resumen la contabilidad del cgroup; devuelve lo escrito
+int cgroup_format(const struct cg_stats *s, char *buf, size_t size) {
+    if (!s->valid || size == 0) return 0;
+    char mem[32] = "n/d", pids[32] = "n/d", io[64] = "n/d";
+    if (s->mem_peak >= 0) snprintf(mem, sizeof(mem), "%lld KB", s->mem_peak / 1024);
+    if (s->pids_peak >= 0) snprintf(pids, sizeof(pids), "%lld", s->pids_peak);
+    if (s->rbytes >= 0) snprintf(io, sizeof(io), "leídos %lld B escritos %lld B", s->rbytes, s->wbytes);
+    int n = snprintf(buf, size, "Cgroup: Usuario: %.6fs  Sistema: %.6fs  MemPico: %s  ProcesosPico: %s  IO: %s\n",
+        s->usr_sec, s->sys_sec, mem, pids, io);
+    if (n < (int)size && s->throttled > 0)
+        n += snprintf(buf + n, size - n, "Frenado por cpu.max: %lld veces, %.6fs\n",
+            s->throttled, s->throttled_usec / 1e6);
+    if (n < (int)size && s->oom_kills > 0)
+        n += snprintf(buf + n, size - n, "Muertes por memory.max: %lld\n", s->oom_kills);
+    if (n < (int)size && s->leftover > 0)
+        n += snprintf(buf + n, size - n, "Procesos que sobrevivieron al comando: %d (terminados)\n", s->leftover);
+    return n < (int)size ? n : (int)size - 1;
+}
+
+// Ejecuta un comando único y mide tiempo y recursos. Con save_file la salida
+// del hijo se transmite al archivo mientras corre, entre encabezado y resumen.
+// Si res no es NULL, recibe las mediciones. Con un formato de métricas se
+// emite además un registro estructurado de la ejecución.
+int run_and_profile(char **argv, struct miprof_opts *opts, struct prof_result *res) {
+    struct timespec start, end, start_wall;
+    struct rusage usage;
+    pid_t pid;
+
+    struct out_stream stream = { .in_fd = -1, .out_fd = -1, .mirror_fd = -1, .tee_fd = {-1, -1} };
+    int child_out = -1;
+
+    if (opts->save_file) {
+        // splice no escribe en archivos abiertos con O_APPEND: se posiciona
+        // al final a mano
+        stream.out_fd = open(opts->save_file, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (stream.out_fd == -1) {
+            perror("abrir archivo de salida");
+            return -1;
+        }
+        lseek(stream.out_fd, 0, SEEK_END);
+        int pipefd[2];
+        if (pipe2(pipefd, O_CLOEXEC) == -1) {
+            perror("pipe");
+            close(stream.out_fd);
+            return -1;
+        }
+        fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+        stream.in_fd = pipefd[0];
+        child_out = pipefd[1];
+        if (opts->mirror) {
+            if (pipe2(stream.tee_fd, O_CLOEXEC) == -1) perror("pipe");
+            else stream.mirror_fd = STDOUT_FILENO;
+        }
+    }
+
+    struct cg_run cg;
+    struct cg_stats cgs = {0};
+    if (cgroup_begin(opts, &cg) == -1) {
+        if (stream.out_fd != -1) { close(stream.out_fd); close(stream.in_fd); close(child_out); }
+        if (stream.tee_fd[0] != -1) { close(stream.tee_fd[0]); close(stream.tee_fd[1]); }
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &start_wall);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int null_fd = -1;
+    if (opts->discard_output && !opts->save_file) {
+        null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        child_out = null_fd;
+    }
+
+    // El límite de tiempo lo hace cumplir el padre (ver wait_child_timeout)
+    int outfd = child_out != -1 ? child_out : STDOUT_FILENO;
+    int errfd = opts->save_file ? child_out : STDERR_FILENO;
+    trace_begin("lanzar", argv[0]);
+    long long t0 = now_ns();
+    pid = spawn_command(argv, opts->redirs, STDIN_FILENO, outfd, errfd, -1);
+    long long t1 = now_ns();
+    stat_add(ST_SPAWN, t1 - t0);
+    trace_end("lanzar");
+    if (child_out != -1) close(child_out);
+    if (pid != -1) {
+        current_child = pid;
+        // La salida solo llega por la tubería, así que el encabezado queda antes
+        if (stream.out_fd != -1) dprintf(stream.out_fd, "---- miprof append: %s ----\n", argv[0]);
+    }
+
+    int status = 0;
+    int timed_out = 0;
+    memset(&usage, 0, sizeof(usage));
+    trace_begin("esperar", NULL);
+    if (pid != -1)
+        timed_out = wait_child_timeout(pid, &status, &usage, opts->timeout, opts->save_file ? &stream : NULL,
+                                       opts->sampler);
+    stat_add(ST_WAIT, now_ns() - t1);
+    trace_end("esperar");
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (pid != -1) trace_span("proceso", pid, &start, &end);
+    cgroup_end(&cg, &cgs);
+
+    // Lo que quede en la tubería se vuelca sin esperar EOF: un nieto que
+    // siga vivo podría mantenerla abierta
+    if (stream.in_fd != -1) {
+        trace_begin("copiar salida", NULL);
+        stream_pump(&stream);
+        close(stream.in_fd);
+        trace_end("copiar salida");
+    }
+    if (stream.tee_fd[0] != -1) { close(stream.tee_fd[0]); close(stream.tee_fd[1]); }
+    if (pid == -1) {
+        if (stream.out_fd != -1) close(stream.out_fd);
+        return -1;
+    }
+
+    double real_sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+    double usr_sec = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1e6;
+    double sys_sec = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1e6;
+    long maxrss = usage.ru_maxrss; // en Linux: kilobytes
+    struct prof_result r = {
+        .real_sec = real_sec, .usr_sec = usr_sec, .sys_sec = sys_sec, .maxrss = maxrss,
+        .usage = usage, .start_wall = start_wall, .pid = pid, .status = status, .timed_out = timed_out,
+    };
+    if (res) *res = r;
+    if (opts->format != FMT_TEXT)
+        write_metrics_record(opts->metrics_fd != -1 ? opts->metrics_fd : STDOUT_FILENO, opts, argv, &r);
+
+    // Crear resumen
+    char summary[1024];
+    int n = snprintf(summary, sizeof(summary),
+        "Comando: %s\nReal: %.6fs  Usuario: %.6fs  Sistema: %.6fs  MaxRSS: %ld\n"
+        "Fallos: menores %ld mayores %ld  CambiosCtx: voluntarios %ld involuntarios %ld  BloquesIO: entrada %ld salida %ld\n"
+        "ExitStatus: %d\n",
+        argv[0], real_sec, usr_sec, sys_sec, maxrss,
+        usage.ru_minflt, usage.ru_majflt, usage.ru_nvcsw, usage.ru_nivcsw, usage.ru_inblock, usage.ru_oublock,
+        WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    if (timed_out && n < (int)sizeof(summary))
+        n += snprintf(summary + n, sizeof(summary) - n, "Límite de tiempo (%gs) excedido\n", opts->timeout);
+    if (n < (int)sizeof(summary)) n += cgroup_format(&cgs, summary + n, sizeof(summary) - n);
+
+    if (stream.out_fd != -1) {
+        // Cerrar el bloque en el archivo con el resumen
+        write(stream.out_fd, summary, n);
+        write(stream.out_fd, "\n", 1);
+        close(stream.out_fd);
+    } else if (!opts->quiet && (opts->format == FMT_TEXT || opts->metrics_fd != -1)) {
+        // Mostrar resumen en pantalla (salvo que los registros ocupen la salida)
+        write(STDOUT_FILENO, summary, n);
+    }
+
+    current_child = 0;
+    return status;
+}
+
+// Tramo entre dos etapas perfiladas: la shell retransmite con splice desde la
+// tubería del productor (from) a la del consumidor (to), contando los bytes y
+// el tiempo en que el consumidor no daba abasto (productor bloqueado al escribir)
+struct pipe_relay {
+    int from, to;
+    unsigned long long bytes;
+    int full;                   // hay datos pendientes y la tubería destino está llena
+    struct timespec full_since;
+    double full_sec;
+};
+
+void relay_set_full(struct pipe_relay *r, int full) {
+    if (full == r->full) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (full) r->full_since = now;
+    else r->full_sec += ts_diff(&r->full_since, &now);
+    r->full = full;
+}
+
+void relay_close(struct pipe_relay *r) {
+    relay_set_full(r, 0);
+    close(r->from);
+    close(r->to);
+    r->from = r->to = -1;
+}
+
+// Mueve lo disponible del productor al consumidor sin bloquear. Cierra el
+// tramo al llegar a EOF o si el consumidor ya no lee (EPIPE).
+void relay_pump(struct pipe_relay *r) {
+    while (r->from != -1) {
+        ssize_t n = splice(r->from, NULL, r->to, NULL, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            r->bytes += n;
+            relay_set_full(r, 0);
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) {
+            // EAGAIN no distingue origen vacío de destino lleno
+            int avail = 0;
+            if (ioctl(r->from, FIONREAD, &avail) == -1) avail = 0;
+            relay_set_full(r, avail > 0);
+            return;
+        }
+        relay_close(r);
+    }
+}
+
+// Perfila una tubería de n etapas: tiempo real, usuario, sistema, tiempo
+// fuera de CPU y MaxRSS por etapa y del total, y bytes y tiempo de
+// contrapresión por tramo. Las etapas se recogen con wait4 a medida que
+// terminan. Devuelve el estado de la última etapa, o -1 si no se pudo armar.
+int profile_pipeline(struct command *cmds, int n, struct miprof_opts *opts) {
+    struct stage_prof st[MAX_COMMANDS];
+    struct pipe_relay rl[MAX_COMMANDS];
+    struct timespec start, end, start_wall;
+    int nspawned = 0, nrelay = 0, live;
+    int in_fd = STDIN_FILENO;
+
+    // Escribir en una tubería sin lectores no debe matar a la shell
+    sigset_t pipeset, oldmask;
+    sigemptyset(&pipeset);
+    sigaddset(&pipeset, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &pipeset, &oldmask);
+
+    // Todas las etapas comparten el cgroup de la ejecución
+    struct cg_run cg;
+    struct cg_stats cgs = {0};
+    if (cgroup_begin(opts, &cg) == -1) {
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &start_wall);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < n; ++i) {
+        int up[2] = {-1, -1}, down[2] = {-1, -1};
+        if (i < n-1 && (pipe2(up, O_CLOEXEC) == -1 || pipe2(down, O_CLOEXEC) == -1)) {
+            perror("pipe");
+            if (up[0] != -1) { close(up[0]); close(up[1]); }
+            break;
+        }
+        if (i < n-1) {
+            apply_pipe_size(up[0]);
+            apply_pipe_size(down[0]);
+        }
+        memset(&st[i], 0, sizeof(st[i]));
+        clock_gettime(CLOCK_MONOTONIC, &st[i].start);
+        st[i].pid = spawn_command(cmds[i].argv, cmds[i].redirs, in_fd, i < n-1 ? up[1] : STDOUT_FILENO, STDERR_FILENO, -1);
+        if (st[i].pid == -1) {
+            st[i].status = 127 << 8;
+            st[i].done = 1;
+            st[i].end = st[i].start;
+        }
+        nspawned++;
+        if (in_fd != STDIN_FILENO) close(in_fd);
+        if (i < n-1) {
+            close(up[1]);
+            rl[nrelay++] = (struct pipe_relay){ .from = up[0], .to = down[1] };
+            in_fd = down[0];
+        }
+    }
+    if (in_fd != STDIN_FILENO) close(in_fd);
+
+    int tfd = timeout_fd(opts->timeout);
+    int timed_out = 0;
+    while (1) {
+        live = reap_stages(st, nspawned, 0);
+        for (int r = 0; r < nrelay; ++r) relay_pump(&rl[r]);
+        if (live == 0) {
+            // Sin etapas vivas ya nadie consumirá lo que quede
+            for (int r = 0; r < nrelay; ++r) if (rl[r].from != -1) relay_close(&rl[r]);
+            break;
+        }
+
+        struct pollfd pfd[2 + MAX_COMMANDS];
+        pfd[0] = (struct pollfd){ .fd = sigchld_fd, .events = POLLIN };
+        pfd[1] = (struct pollfd){ .fd = tfd, .events = POLLIN };
+        for (int r = 0; r < nrelay; ++r) {
+            // Con el destino lleno se espera a que el consumidor lea
+            if (rl[r].full) pfd[2+r] = (struct pollfd){ .fd = rl[r].to, .events = POLLOUT };
+            else pfd[2+r] = (struct pollfd){ .fd = rl[r].from, .events = POLLIN };
+        }
+        for (int i = 0; i < nspawned; ++i)
+            if (!st[i].done) { current_child = st[i].pid; break; }
+        if (poll(pfd, 2 + nrelay, -1) == -1) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        if (pfd[0].revents & POLLIN) drain_sigchld();
+        if (tfd != -1 && (pfd[1].revents & POLLIN)) {
+            for (int i = 0; i < nspawned; ++i) if (!st[i].done) kill(st[i].pid, SIGKILL);
+            close(tfd);
+            tfd = -1;
+            timed_out = 1;
+        }
+    }
+    if (tfd != -1) close(tfd);
+    current_child = 0;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    cgroup_end(&cg, &cgs);
+
+    // Descartar el SIGPIPE que haya quedado pendiente antes de desbloquearlo
+    struct timespec zero = {0};
+    while (sigtimedwait(&pipeset, NULL, &zero) > 0) {}
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+    int to_stdout = opts->format != FMT_TEXT && opts->metrics_fd == -1;
+    double real_sec = ts_diff(&start, &end);
+    double tot_usr = 0, tot_sys = 0;
+    long tot_rss = 0;
+    int bottleneck = -1;
+    double best_cpu = -1;
+    for (int i = 0; i < nspawned; ++i) {
+        struct prof_result r = {
+            .real_sec = ts_diff(&st[i].start, &st[i].end),
+            .usr_sec = st[i].usage.ru_utime.tv_sec + st[i].usage.ru_utime.tv_usec/1e6,
+            .sys_sec = st[i].usage.ru_stime.tv_sec + st[i].usage.ru_stime.tv_usec/1e6,
+            .maxrss = st[i].usage.ru_maxrss, .usage = st[i].usage, .start_wall = start_wall,
+            .pid = st[i].pid, .status = st[i].status, .timed_out = timed_out,
+        };
+        tot_usr += r.usr_sec;
+        tot_sys += r.sys_sec;
+        if (r.maxrss > tot_rss) tot_rss = r.maxrss;
+        // Cuello de botella probable: la etapa que pasó más fracción de su
+        // tiempo en CPU (las demás esperan por ella en las tuberías)
+        double cpu = r.real_sec > 0 ? (r.usr_sec + r.sys_sec) / r.real_sec : 0;
+        if (st[i].pid != -1 && cpu > best_cpu) { best_cpu = cpu; bottleneck = i; }
+        if (opts->format != FMT_TEXT)
+            write_metrics_record(opts->metrics_fd != -1 ? opts->metrics_fd : STDOUT_FILENO, opts, cmds[i].argv, &r);
+        if (opts->quiet || to_stdout) continue;
+
+        if (i == 0) {
+            printf("Tubería de %d etapas\n", n);
+            printf("%-6s%-16s%12s%12s%12s%12s%10s%10s\n", "Etapa", "Comando", "Real(s)", "Usuario(s)",
+                "Sistema(s)", "FueraCPU(s)", "MaxRSS", "Salida");
+        }
+        // Todo el tiempo fuera de CPU: tubería vacía o llena, disco, cola del
+        // planificador. Cuánto de eso fue esperar al productor no se mide
+        double wait_sec = r.real_sec - r.usr_sec - r.sys_sec;
+        char exitbuf[16];
+        if (WIFEXITED(r.status)) snprintf(exitbuf, sizeof(exitbuf), "%d", WEXITSTATUS(r.status));
+        else if (WIFSIGNALED(r.status)) snprintf(exitbuf, sizeof(exitbuf), "sig %d", WTERMSIG(r.status));
+        else snprintf(exitbuf, sizeof(exitbuf), "?");
+        printf("%-6d%-16.16s%12.6f%12.6f%12.6f%12.6f%10ld%10s\n", i + 1, cmds[i].argv[0], r.real_sec,
+            r.usr_sec, r.sys_sec, wait_sec > 0 ? wait_sec : 0, r.maxrss, exitbuf);
+    }
+    if (!opts->quiet && !to_stdout && nspawned > 0) {
+        printf("%-6s%-16s%12.6f%12.6f%12.6f%12s%10ld\n", "Total", "", real_sec, tot_usr, tot_sys, "", tot_rss);
+        if (nrelay > 0) printf("%-6s%16s%12s%12s\n", "Tramo", "Bytes", "MB/s", "Lleno(s)");
+        for (int r = 0; r < nrelay; ++r) {
+            char label[32];   // cabe "%d->%d" con cualquier int
+            snprintf(label, sizeof(label), "%d->%d", r + 1, r + 2);
+            printf("%-6s%16llu%12.2f%12.6f\n", label, rl[r].bytes,
+                real_sec > 0 ? rl[r].bytes / real_sec / 1e6 : 0, rl[r].full_sec);
+        }
+        if (bottleneck != -1)
+            printf("Cuello de botella probable: etapa %d (%s), %.0f%% de su tiempo en CPU\n",
+                bottleneck + 1, cmds[bottleneck].argv[0], best_cpu * 100);
+        if (timed_out) printf("Límite de tiempo (%gs) excedido\n", opts->timeout);
+        char cgbuf[512];
+        if (cgroup_format(&cgs, cgbuf, sizeof(cgbuf)) > 0) fputs(cgbuf, stdout);
+    }
+    if (nspawned < n) return -1;
+    return st[n-1].status;
+}
+
+// Builtin hash: sin argumentos lista la caché, -r la vacía, -d olvida
+// comandos y con nombres los resuelve de antemano
+int builtin_hash(char **argv) {
+    if (!argv[1]) {
+        printf("aciertos\tcomando\n");
+        for (int i = 0; i < PATH_CACHE_BUCKETS; ++i)
+            for (struct path_entry *e = path_cache[i]; e; e = e->next)
+                printf("%8lu\t%s\n", e->hits, e->path);
+        return 0;
+    }
+    if (strcmp(argv[1], "-r") == 0) {
+        path_cache_clear();
+        return 0;
+    }
+    if (strcmp(argv[1], "-d") == 0) {
+        for (int i = 2; argv[i]; ++i) path_cache_forget(argv[i]);
+        return 0;
+    }
+    for (int i = 1; argv[i]; ++i) {
+        int found;
+        if (strchr(argv[i], '/') || !path_cache_lookup(argv[i], &found, NULL))
+            fprintf(stderr, "mishell: hash: %s: no encontrado\n", argv[i]);
+    }
+    return 0;
+}
+
+// Estadísticos de una serie de mediciones
+struct series_stats {
+    double min, mean, median, p95, p99, max, stddev;
+    double q1, q3;
+};
+
+int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Percentil p (0..100) de un arreglo ordenado, interpolando entre vecinos
+double percentile(const double *sorted, int n, double p) {
+    double pos = (n - 1) * p / 100.0;
+    int lo = (int)pos;
+    if (lo + 1 >= n) return sorted[n-1];
+    return sorted[lo] + (pos - lo) * (sorted[lo+1] - sorted[lo]);
+}
+
+void compute_stats(const double *v, int n, struct series_stats *st) {
+    double *sorted = malloc(sizeof(double) * n);
+    memcpy(sorted, v, sizeof(double) * n);
+    qsort(sorted, n, sizeof(double), cmp_double);
+    double sum = 0;
+    for (int i = 0; i < n; ++i) sum += v[i];
+    st->mean = sum / n;
+    double var = 0;
+    for (int i = 0; i < n; ++i) var += (v[i] - st->mean) * (v[i] - st->mean);
+    st->stddev = n > 1 ? sqrt(var / (n - 1)) : 0;
+    st->min = sorted[0];
+    st->max = sorted[n-1];
+    st->median = percentile(sorted, n, 50);
+    st->p95 = percentile(sorted, n, 95);
+    st->p99 = percentile(sorted, n, 99);
+    st->q1 = percentile(sorted, n, 25);
+    st->q3 = percentile(sorted, n, 75);
+    free(sorted);
+}
+
+void print_stats_row(const char *label, const double *v, int n, const char *fmt) {
+    struct series_stats st;
+    compute_stats(v, n, &st);
+    double cols[7] = { st.min, st.mean, st.median, st.p95, st.p99, st.max, st.stddev };
+    printf("%-12s", label);
+    for (int i = 0; i < 7; ++i) printf(fmt, cols[i]);
+    printf("\n");
+}
+
+// miprof repeat: ejecuta el comando warmup veces sin medir y luego n veces
+// midiendo; reporta min/media/mediana/p95/p99/max/desviación y marca como
+// atípicas las ejecuciones fuera de [Q1 - 1.5 IQR, Q3 + 1.5 IQR] en tiempo real.
+// Solo las ejecuciones medidas emiten registro de métricas. Devuelve el
+// estado de la última ejecución fallida (0 si todas salieron bien) o -1 si
+// alguna no se pudo lanzar.
+int miprof_repeat(char **argv, int n, int warmup, struct miprof_opts *opts) {
+    struct miprof_opts warm = { .quiet = 1, .discard_output = 1, .metrics_fd = -1, .redirs = opts->redirs,
+        .cgroup = opts->cgroup, .memory_max = opts->memory_max, .cpu_max = opts->cpu_max };
+    struct prof_result r;
+    opts->quiet = 1;
+    opts->discard_output = 1;
+
+    for (int i = 0; i < warmup; ++i)
+        if (run_and_profile(argv, &warm, NULL) == -1) return -1;
+
+    double *vals = malloc(sizeof(double) * n * 4);
+    double *real = vals, *usr = vals + n, *sys = vals + 2*n, *rss = vals + 3*n;
+    int failed = 0, last_failed = 0;
+    for (int i = 0; i < n; ++i) {
+        if (run_and_profile(argv, opts, &r) == -1) { free(vals); return -1; }
+        real[i] = r.real_sec;
+        usr[i] = r.usr_sec;
+        sys[i] = r.sys_sec;
+        rss[i] = r.maxrss;
+        if (!WIFEXITED(r.status) || WEXITSTATUS(r.status) != 0) { failed++; last_failed = r.status; }
+    }
+
+    // Los registros ya ocupan la salida estándar: no se mezcla la tabla
+    if (opts->format != FMT_TEXT && opts->metrics_fd == -1) { free(vals); return last_failed; }
+
+    printf("Comando: %s  (%d ejecuciones, %d de calentamiento)\n", argv[0], n, warmup);
+    printf("%-12s%12s%12s%12s%12s%12s%12s%12s\n", "", "min", "media", "mediana", "p95", "p99", "max", "desv");
+    print_stats_row("Real (s)", real, n, "%12.6f");
+    print_stats_row("Usuario (s)", usr, n, "%12.6f");
+    print_stats_row("Sistema (s)", sys, n, "%12.6f");
+    print_stats_row("MaxRSS (KB)", rss, n, "%12.0f");
+
+    struct series_stats st;
+    compute_stats(real, n, &st);
+    double iqr = st.q3 - st.q1;
+    double lo = st.q1 - 1.5 * iqr, hi = st.q3 + 1.5 * iqr;
+    int outliers = 0;
+    for (int i = 0; i < n; ++i) if (real[i] < lo || real[i] > hi) outliers++;
+    if (outliers > 0) {
+        printf("Atípicos: %d de %d ejecuciones fuera de [%.6f, %.6f]s:", outliers, n, lo, hi);
+        for (int i = 0; i < n; ++i) if (real[i] < lo || real[i] > hi) printf(" #%d", i + 1);
+        printf("\n");
+    }
+    if (failed > 0) printf("Advertencia: %d ejecuciones terminaron con error\n", failed);
+    free(vals);
+    return last_failed;
+}
+
+// Perfila argv o, si hay etapas adicionales (las que siguen a '|'), la
+// tubería completa con argv como primera etapa
+int miprof_run(char **argv, struct command *stages, int nstages, struct miprof_opts *opts) {
+    if (nstages == 0) return run_and_profile(argv, opts, NULL);
+    struct command cmds[MAX_COMMANDS];
+    cmds[0].argv = argv;
+    cmds[0].redirs = opts->redirs;
+    for (cmds[0].argc = 0; argv[cmds[0].argc]; cmds[0].argc++) {}
+    memcpy(&cmds[1], stages, sizeof(struct command) * nstages);
+    return profile_pipeline(cmds, nstages + 1, opts);
+}
+
+// Índice sobre los nombres de una tabla (el nombre es el primer campo de
+// cada entrada), con hash y desplazamiento en dos niveles: un primer hash
+// reparte los nombres en grupos de unos dos, y el desplazamiento de cada
+// grupo, buscado al armar el índice, lleva a cada uno de sus nombres a una
+// casilla propia. Buscar cuesta dos hashes y un solo strcmp; armarlo es
+// prácticamente lineal porque hay el doble de casillas que de nombres. Si
+// algún grupo no encuentra desplazamiento dentro del límite (nombres
+// repetidos, por ejemplo), el índice recurre a recorrer la tabla.
+#define NAME_DISP_MAX 65536
+struct name_index {
+    int n;
+    int ngroups;                // 0 = sin índice: búsqueda lineal
+    unsigned mask;              // casillas - 1 (potencia de 2)
+    unsigned *disp;             // desplazamiento de cada grupo
+    int *slot;                  // posición + 1 en la tabla (0 = vacía)
+};
+
+unsigned name_hash(const char *s, unsigned seed) {
+    unsigned h = 2166136261u ^ seed;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    // Los bits bajos de FNV solo dependen de los bajos de la semilla: se
+    // mezclan antes de reducir
+    h ^= h >> 16;
+    h *= 0x45d9f3bu;
+    h ^= h >> 16;
+    return h;
+}
+
+#define ENTRY_NAME(table, stride, i) (*(const char * const *)((const char *)(table) + (size_t)(i) * (stride)))
+
+void name_index_build(struct name_index *ix, const void *table, size_t stride, int n) {
+    unsigned nslots = 2;
+    while (nslots < 2u * n) nslots *= 2;
+    ix->n = n;
+    ix->mask = nslots - 1;
+    ix->ngroups = n / 2 + 1;
+    ix->disp = calloc(ix->ngroups, sizeof(unsigned));
+    ix->slot = calloc(nslots, sizeof(int));
+    // Los nombres se ordenan por grupo: los de g ocupan members[start[g]..start[g+1])
+    int *group = malloc(sizeof(int) * n), *start = calloc(ix->ngroups + 1, sizeof(int));
+    int *members = malloc(sizeof(int) * n);
+    int maxsize = 0;
+    for (int i = 0; i < n; ++i) {
+        group[i] = name_hash(ENTRY_NAME(table, stride, i), 0) % ix->ngroups;
+        start[group[i] + 1]++;
+    }
+    for (int g = 0; g < ix->ngroups; ++g) {
+        if (start[g + 1] > maxsize) maxsize = start[g + 1];
+        start[g + 1] += start[g];
+    }
+    int *cursor = malloc(sizeof(int) * ix->ngroups);
+    memcpy(cursor, start, sizeof(int) * ix->ngroups);
+    for (int i = 0; i < n; ++i) members[cursor[group[i]]++] = i;
+    free(cursor);
+    // Los grupos grandes se ubican primero, mientras quedan casillas libres
+    for (int sz = maxsize; sz > 0 && ix->ngroups; --sz) {
+        for (int g = 0; g < ix->ngroups; ++g) {
+            int k = start[g + 1] - start[g];
+            if (k != sz) continue;
+            int *m = members + start[g];
+            unsigned d;
+            for (d = 1; d <= NAME_DISP_MAX; ++d) {
+                int j;
+                for (j = 0; j < k; ++j) {
+                    unsigned h = name_hash(ENTRY_NAME(table, stride, m[j]), d) & ix->mask;
+                    if (ix->slot[h]) break;
+                    ix->slot[h] = m[j] + 1;
+                }
+                if (j == k) break;
+                // Choca: se deshace lo ubicado en este intento
+                while (j-- > 0) ix->slot[name_hash(ENTRY_NAME(table, stride, m[j]), d) & ix->mask] = 0;
+            }
+            if (d > NAME_DISP_MAX) {
+                ix->ngroups = 0;
+                break;
+            }
+            ix->disp[g] = d;
+        }
+    }
+    free(group);
+    free(start);
+    free(members);
+}
+
+// Devuelve la posición de name en la tabla, o -1
+int name_index_find(const struct name_index *ix, const void *table, size_t stride, const char *name) {
+    if (!ix->ngroups) {
+        for (int i = 0; i < ix->n; ++i) if (strcmp(ENTRY_NAME(table, stride, i), name) == 0) return i;
+        return -1;
+    }
+    unsigned d = ix->disp[name_hash(name, 0) % ix->ngroups];
+    int k = ix->slot[name_hash(name, d) & ix->mask];
+    return k && strcmp(ENTRY_NAME(table, stride, k - 1), name) == 0 ? k - 1 : -1;
+}
+
+// Modos de miprof: argv[0] es el nombre del modo. Devuelven el código de
+// salida del comando perfilado (128 + señal si lo mataron, también por
+// límite de tiempo), 2 si un argumento no sirve, o -1 si los argumentos no
+// alcanzan (se muestra el uso de la tabla).
+int mode_ejec(char **argv, struct command *stages, int nstages, struct miprof_opts *opts) {
+    return exit_code(miprof_run(&argv[1], stages, nstages, opts));
+}
+
+int mode_ejecsave(char **argv, struct command *stages, int nstages, struct miprof_opts *opts) {
+    (void)stages;
+    (void)nstages;
+    int a = 1;
+    if (strcmp(argv[a], "-t") == 0 || strcmp(argv[a], "--tee") == 0) { opts->mirror = 1; a++; }
+    if (!argv[a] || !argv[a+1]) return -1;
+    opts->save_file = argv[a];
+    return exit_code(run_and_profile(&argv[a+1], opts, NULL));
+}
+
+int mode_maxtiempo(char **argv, struct command *stages, int nstages, struct miprof_opts *opts) {
+    char *end;
+    opts->timeout = strtod(argv[1], &end);
+    if (*end != '\0' || end == argv[1] || opts->timeout <= 0) {
+        fprintf(stderr, "miprof: tiempo inválido: %s\n", argv[1]);
+        return 2;
+    }
+    return exit_code(miprof_run(&argv[2], stages, nstages, opts));
+}
+
+int mode_repeat(char **argv, struct command *stages, int nstages, struct miprof_opts *opts) {
+    (void)stages;
+    (void)nstages;
+    int a = 2, warmup = 0;
+    int n = atoi(argv[1]);
+    if (strcmp(argv[a], "--warmup") == 0) {
+        warmup = argv[a+1] ? atoi(argv[a+1]) : -1;
+        a += 2;
+    }
+    if (n <= 0 || warmup < 0 || !argv[a]) return -1;
+    return exit_code(miprof_repeat(&argv[a], n, warmup, opts));
+}
+
+// Contador de perf_event_open para miprof counters
+struct perf_counter {
+    const char *name;
+    unsigned type;
+    unsigned long long config;
+    int fd;
+    unsigned long long value;   // escalado si el kernel lo multiplexó
+    int ok;                     // se pudo abrir
+};
+
+// Abre un contador sobre la propia shell, apagado, heredable y que se
+// enciende en exec: la shell nunca hace exec, así que solo cuenta el hijo
+// que se lance a continuación (y sus hilos e hijos). Si el kernel no deja
+// medir el modo núcleo (perf_event_paranoid), se mide solo el de usuario.
+int perf_counter_open(struct perf_counter *c) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = c->type;
+    attr.config = c->config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.enable_on_exec = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    c->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (c->fd == -1 && (errno == EACCES || errno == EPERM)) {
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        c->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    c->ok = c->fd != -1;
+    return c->fd;
+}
+
+// Lee y cierra el contador; si compartió el PMU con otros eventos se
+// extrapola según el tiempo que estuvo realmente contando
+void perf_counter_close(struct perf_counter *c) {
+    unsigned long long v[3] = {0, 0, 0};     // valor, habilitado, contando
+    c->value = 0;
+    if (read(c->fd, v, sizeof(v)) == (ssize_t)sizeof(v)) {
+        c->value = v[0];
+        if (v[2] > 0 && v[2] < v[1]) c->value = (unsigned long long)((double)v[0] * v[1] / v[2]);
+    }
+    close(c->fd);
+    c->fd = -1;
+}
+
+double ratio(unsigned long long a, unsigned long long b) {
+    return b ? (double)a / b : 0;
+}
+
+// miprof counters comando args...: contadores de hardware (ciclos,
+// instrucciones, IPC, referencias y fallos de caché, saltos mal predichos)
+// del comando; sin PMU (p. ej. en una VM) usa eventos de software
+int mode_counters(char **argv, struct command *stages, int nstages, struct miprof_opts *opts) {
+    (void)stages;
+    (void)nstages;
+    enum { CYC, INS, CREF, CMISS, BR, BMISS };
+    struct perf_counter hw[] = {
+        { "ciclos", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, 0, 0 },
+        { "instrucciones", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, 0, 0 },
+        { "refs-cache", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES, -1, 0, 0 },
+        { "fallos-cache", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1, 0, 0 },
+        { "saltos", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS, -1, 0, 0 },
+        { "saltos-fallidos", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1, 0, 0 },
+    };
+    struct perf_counter sw[] = {
+        { "task-clock(ns)", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1, 0, 0 },
+        { "cambios-ctx", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, -1, 0, 0 },
+        { "migraciones-cpu", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, -1, 0, 0 },
+        { "fallos-pagina", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1, 0, 0 },
+    };
+    int nhw = sizeof(hw) / sizeof(hw[0]), nsw = sizeof(sw) / sizeof(sw[0]);
+    int have_hw = 0, have_sw = 0;
+    for (int i = 0; i < nhw; ++i)
+        if (perf_counter_open(&hw[i]) != -1) have_hw++;
+    // Sin ciclos no hay PMU útil: se cae a los eventos de software
+    if (hw[CYC].fd == -1 || hw[INS].fd == -1) {
+        for (int i = 0; i < nhw; ++i)
+            if (hw[i].fd != -1) { close(hw[i].fd); hw[i].fd = -1; hw[i].ok = 0; }
+        have_hw = 0;
+    }
+    for (int i = 0; i < nsw; ++i)
+        if (perf_counter_open(&sw[i]) != -1) have_sw++;
+    if (!have_hw && !have_sw) {
+        fprintf(stderr, "miprof: perf_event_open: %s\n", strerror(errno));
+        return 1;
+    }
+
+    int status = run_and_profile(&argv[1], opts, NULL);
+    for (int i = 0; i < nhw; ++i) if (hw[i].fd != -1) perf_counter_close(&hw[i]);
+    for (int i = 0; i < nsw; ++i) if (sw[i].fd != -1) perf_counter_close(&sw[i]);
+    if (status == -1) return exit_code(status);
+
+    if (have_hw) {
+        printf("Contadores de hardware:\n");
+        for (int i = 0; i < nhw; ++i)
+            if (hw[i].ok) printf("  %-16s %15llu\n", hw[i].name, hw[i].value);
+        printf("  %-16s %15.2f\n", "IPC", ratio(hw[INS].value, hw[CYC].value));
+        if (hw[CREF].ok && hw[CMISS].ok) printf("  %-16s %14.2f%%\n", "fallos/refs", 100 * ratio(hw[CMISS].value, hw[CREF].value));
+        if (hw[BR].ok && hw[BMISS].ok) printf("  %-16s %14.2f%%\n", "saltos fallidos", 100 * ratio(hw[BMISS].value, hw[BR].value));
+    } else {
+        printf("Sin PMU de hardware: eventos de software\n");
+    }
+    if (have_sw) {
+        if (have_hw) printf("Contadores de software:\n");
+        for (int i = 0; i < nsw; ++i)
+            if (sw[i].ok) printf("  %-16s %15llu\n", sw[i].name, sw[i].value);
+    }
+    fflush(stdout);
+    // Los contadores se encienden en exec y un builtin nunca lo hace
+    const struct builtin *b = find_builtin(argv[1]);
+    if (b && b->fn)
+        fprintf(stderr, "miprof: %s es un builtin y no hace exec: los contadores quedan a cero\n", argv[1]);
+    return exit_code(status);
+}
 
-static volatile pid_t current_child = 0;
+// Duración con sufijo us, ms o s (sin sufijo, segundos); -1 si no sirve
+double parse_duration(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v <= 0) return -1;
+    if (strcmp(end, "us") == 0) return v / 1e6;
+    if (strcmp(end, "ms") == 0) return v / 1e3;
+    if (strcmp(end, "s") == 0 || *end == '\0') return v;
+    return -1;
+}
 
-// Manejador de señal SIGINT (Ctrl-C)
-void sigint_handler(int sig) {
-    (void)sig;
-    if (current_child > 0) {
-        kill(current_child, SIGINT);
+// Serie de muestras: ms desde el inicio, % de CPU en el intervalo (100 = una
+// CPU), RSS, procesos, hilos y bytes leídos/escritos acumulados
+void sampler_write(const struct sampler *s, FILE *f) {
+    fprintf(f, "#t_ms\tcpu%%\trss_kb\tprocs\thilos\tleidos\tescritos\n");
+    for (int i = 0; i < s->n; ++i) {
+        const struct sample *m = &s->samples[i];
+        double dt = i ? m->t - s->samples[i-1].t : 0;
+        double cpu = dt > 0 ? (m->cpu_sec - s->samples[i-1].cpu_sec) / dt * 100 : 0;
+        fprintf(f, "%.1f\t%.0f\t%ld\t%d\t%d\t%lld\t%lld\n", m->t * 1e3, cpu, m->rss_kb,
+            m->nprocs, m->nthreads, m->rchar, m->wchar);
     }
 }
 
-// Elimina espacios/tabuladores/nuevas líneas al inicio y fin
-char *trim(char *s) {
-    while (*s == ' ' || *s == '\t' || *s == '\n') s++;
-    char *end = s + strlen(s) - 1;
-    while (end > s && (*end == ' ' || *end == '\t' || *end == '\n')) *end-- = '\0';
-    return s;
+// miprof sample [--interval 10ms] [-o archivo] comando args...: serie
+// temporal de CPU, RSS y E/S del árbol del comando mientras corre
+int mode_sample(char **argv, struct command *stages, int nstages, struct miprof_opts *opts) {
+    (void)stages;
+    (void)nstages;
+    struct sampler s = { .interval = 0.01, .tfd = -1, .cg_procs_fd = -1 };
+    int a = 1;
+    while (argv[a] && argv[a+1]) {
+        if (strcmp(argv[a], "--interval") == 0) {
+            s.interval = parse_duration(argv[a+1]);
+            if (s.interval < 0.001) {
+                fprintf(stderr, "miprof: intervalo inválido: %s (mínimo 1ms)\n", argv[a+1]);
+                return 2;
+            }
+        } else if (strcmp(argv[a], "-o") == 0) {
+            s.out_file = argv[a+1];
+        } else {
+            break;
+        }
+        a += 2;
+    }
+    if (!argv[a]) return -1;
+
+    FILE *out = NULL;
+    if (s.out_file && !(out = fopen(s.out_file, "we"))) {
+        perror("abrir archivo de muestras");
+        return 1;
+    }
+    opts->sampler = &s;
+    struct prof_result r;
+    int status = run_and_profile(&argv[a], opts, &r);
+    opts->sampler = NULL;
+    if (status != -1 && s.n > 0) {
+        int peak = 0;
+        for (int i = 1; i < s.n; ++i) if (s.samples[i].rss_kb > s.samples[peak].rss_kb) peak = i;
+        if (out) sampler_write(&s, out);
+        else sampler_write(&s, stdout);
+        printf("Muestras: %d cada %gms  RSS pico: %ld KB a los %.1fms  Costo del muestreo: %.2f%% de una CPU\n",
+            s.n, s.asked * 1e3, s.samples[peak].rss_kb, s.samples[peak].t * 1e3,
+            r.real_sec > 0 ? s.self_sec / r.real_sec * 100 : 0);
+        if (s.interval > s.asked)
+            printf("El intervalo se amplió a %gms para no pasar del 1%% de una CPU\n", s.interval * 1e3);
+        fflush(stdout);
+    }
+    if (out) fclose(out);
+    free(s.samples);
+    return exit_code(status);
 }
 
-// Divide una línea en comandos separados por '|'
-int split_pipeline(char *line, char *commands[]) {
-    int n = 0;
-    char *saveptr;
-    char *tok = strtok_r(line, "|", &saveptr);
-    while (tok && n < MAX_COMMANDS) {
-        commands[n++] = trim(tok);
-        tok = strtok_r(NULL, "|", &saveptr);
+// Tabla de modos de miprof: la usan el despacho, help y compgen
+struct miprof_mode {
+    const char *name;
+    int (*fn)(char **argv, struct command *stages, int nstages, struct miprof_opts *opts);
+    int min_args;               // argumentos después del modo
+    int pipelines;              // acepta tuberías
+    const char *usage;
+    const char *help;
+};
+static const struct miprof_mode miprof_modes[] = {
+    { "ejec", mode_ejec, 1, 1, "comando args...", "mide tiempos y recursos (también por etapa de una tubería)" },
+    { "ejecsave", mode_ejecsave, 2, 0, "[-t] archivo comando args...", "añade la salida y el resumen a archivo (-t también en pantalla)" },
+    { "maxtiempo", mode_maxtiempo, 2, 1, "segs comando args...", "como ejec, con un límite de tiempo" },
+    { "repeat", mode_repeat, 2, 0, "N [--warmup K] comando args...", "N ejecuciones medidas con estadísticas" },
+    { "counters", mode_counters, 1, 0, "comando args...", "ciclos, instrucciones, IPC, caché y saltos (perf_event_open)" },
+    { "sample", mode_sample, 1, 0, "[--interval 10ms] [-o archivo] comando args...", "serie temporal de CPU, RSS y E/S del árbol del comando" },
+};
+#define NMIPROF_MODES ((int)(sizeof(miprof_modes) / sizeof(miprof_modes[0])))
+static struct name_index miprof_mode_index;
+
+const struct miprof_mode *find_miprof_mode(const char *name) {
+    int i = name_index_find(&miprof_mode_index, miprof_modes, sizeof(miprof_modes[0]), name);
+    return i == -1 ? NULL : &miprof_modes[i];
+}
+
+// Builtin miprof: perfila un comando en alguno de sus modos. Antes del modo
+// se aceptan --format json|csv y --metrics archivo o --metrics-fd N para
+// emitir un registro estructurado por ejecución. stages son los tramos de
+// una tubería que sigue al comando (ejec y maxtiempo la perfilan por etapa).
+// Devuelve el código de salida del modo (el del comando perfilado) o 2 si
+// el uso no es correcto.
+int builtin_miprof(char **argv, struct redir *redirs, struct command *stages, int nstages) {
+    static const char *usage_msg =
+        "uso: miprof [--format json|csv] [--metrics archivo|--metrics-fd N] [--cgroup auto|dir]\n"
+        "            [--memory-max bytes] [--cpu-max cuota|N%] modo args...\n";
+    struct miprof_opts opts = { .metrics_fd = -1, .redirs = redirs };
+    int own_fd = 0, code = 2;
+    int a = 1;
+    while (argv[a] && strncmp(argv[a], "--", 2) == 0) {
+        if (!argv[a+1]) { fprintf(stderr, "%s", usage_msg); goto out; }
+        if (strcmp(argv[a], "--format") == 0) {
+            if (strcmp(argv[a+1], "json") == 0) opts.format = FMT_JSON;
+            else if (strcmp(argv[a+1], "csv") == 0) opts.format = FMT_CSV;
+            else if (strcmp(argv[a+1], "text") == 0) opts.format = FMT_TEXT;
+            else { fprintf(stderr, "miprof: formato desconocido %s\n", argv[a+1]); goto out; }
+        } else if (strcmp(argv[a], "--metrics") == 0) {
+            if (own_fd) close(opts.metrics_fd);
+            opts.metrics_fd = open(argv[a+1], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (opts.metrics_fd == -1) { perror("abrir archivo de métricas"); own_fd = 0; code = 1; goto out; }
+            own_fd = 1;
+        } else if (strcmp(argv[a], "--metrics-fd") == 0) {
+            char *end;
+            long fd = strtol(argv[a+1], &end, 10);
+            if (*end != '\0' || end == argv[a+1] || fd < 0 || fcntl((int)fd, F_GETFD) == -1) {
+                fprintf(stderr, "miprof: descriptor inválido: %s\n", argv[a+1]);
+                goto out;
+            }
+            if (own_fd) close(opts.metrics_fd);
+            opts.metrics_fd = (int)fd;
+            own_fd = 0;
+        } else if (strcmp(argv[a], "--cgroup") == 0) {
+            opts.cgroup = argv[a+1];
+        } else if (strcmp(argv[a], "--memory-max") == 0) {
+            opts.memory_max = argv[a+1];
+        } else if (strcmp(argv[a], "--cpu-max") == 0) {
+            opts.cpu_max = argv[a+1];
+        } else {
+            fprintf(stderr, "miprof: opción desconocida %s\n", argv[a]);
+            goto out;
+        }
+        a += 2;
+    }
+    // Sin formato explícito, un destino de métricas implica JSON
+    if (opts.metrics_fd != -1 && opts.format == FMT_TEXT) opts.format = FMT_JSON;
+    // Los límites solo existen dentro de un cgroup
+    if ((opts.memory_max || opts.cpu_max) && !opts.cgroup) opts.cgroup = "auto";
+    // Desde aquí argv[1] es el modo
+    argv += a - 1;
+
+    const struct miprof_mode *m = argv[1] ? find_miprof_mode(argv[1]) : NULL;
+    int argc = 0;
+    if (argv[1]) while (argv[argc + 2]) argc++;
+    if (!argv[1]) {
+        fprintf(stderr, "%s", usage_msg);
+    } else if (!m) {
+        fprintf(stderr, "miprof: modo desconocido %s\n", argv[1]);
+    } else if (nstages > 0 && !m->pipelines) {
+        fprintf(stderr, "miprof: %s no admite tuberías\n", m->name);
+    } else if (argc < m->min_args || (code = m->fn(&argv[1], stages, nstages, &opts)) == -1) {
+        fprintf(stderr, "uso: miprof %s %s\n", m->name, m->usage);
+        code = 2;
+    }
+out:
+    if (own_fd) close(opts.metrics_fd);
+    return code;
+}
+
+// Salida retenida de un trabajo de parallel
+struct out_buf {
+    char *data;
+    size_t len, cap;
+};
+
+// Trabajo de parallel: argv propio, etapa para wait4 y salidas retenidas
+struct par_job {
+    char **argv;                // un solo bloque: punteros y texto
+    struct stage_prof st;
+    struct timespec start_wall;
+    int fds[2];                 // lectura de stdout y stderr (-1 = EOF)
+    struct out_buf out[2];
+    int state;                  // PJ_*
+};
+enum { PJ_PENDING, PJ_RUNNING, PJ_FINISHED, PJ_FLUSHED };
+
+// Lee lo disponible en fd hacia b. Devuelve 0 en EOF o error, 1 si queda abierto.
+int out_buf_read(struct out_buf *b, int fd) {
+    while (1) {
+        if (b->cap - b->len < 4096) {
+            size_t cap = b->cap ? b->cap * 2 : 8192;
+            char *d = realloc(b->data, cap);
+            if (!d) return 0;
+            b->data = d;
+            b->cap = cap;
+        }
+        ssize_t r = read(fd, b->data + b->len, b->cap - b->len);
+        if (r > 0) { b->len += r; continue; }
+        if (r == -1 && errno == EINTR) continue;
+        return r == -1 && errno == EAGAIN;
     }
-    return n;
 }
 
-// Parsea un comando en un arreglo argv (modifica la cadena de entrada)
-char **parse_args(char *cmd) {
-    char **argv = malloc(sizeof(char*) * (MAX_TOKENS+1));
-    int i = 0;
-    char *saveptr;
-    char *tok = strtok_r(cmd, " \t\n", &saveptr);
-    while (tok && i < MAX_TOKENS) {
-        argv[i++] = tok;
-        tok = strtok_r(NULL, " \t\n", &saveptr);
+// Arma el argv del trabajo: cada "{}" de la plantilla se reemplaza por arg;
+// si la plantilla no tiene "{}", arg va al final
+char **par_build_argv(char **tmpl, int tc, const char *arg) {
+    size_t alen = strlen(arg), size = 0;
+    int subst = 0;
+    for (int i = 0; i < tc; ++i) {
+        size += strlen(tmpl[i]) + 1;
+        for (const char *p = tmpl[i]; (p = strstr(p, "{}")); p += 2) { size += alen; subst++; }
+    }
+    if (!subst) size += alen + 1;
+    char **argv = malloc(sizeof(char*) * (tc + 2) + size);
+    if (!argv) return NULL;
+    char *p = (char *)(argv + tc + 2);
+    int k = 0;
+    for (int i = 0; i < tc; ++i) {
+        argv[k++] = p;
+        const char *s = tmpl[i], *m;
+        while ((m = strstr(s, "{}"))) {
+            memcpy(p, s, m - s);
+            p = stpcpy(p + (m - s), arg);
+            s = m + 2;
+        }
+        p = stpcpy(p, s) + 1;
     }
-    argv[i] = NULL;
+    if (!subst) { argv[k++] = p; strcpy(p, arg); }
+    argv[k] = NULL;
     return argv;
 }
 
-// Ejecuta una tubería de comandos (arreglo commands con n elementos)
-int execute_pipeline(char *commands[], int n) {
-    int i;
-    int in_fd = STDIN_FILENO;
-    pid_t pids[MAX_COMMANDS];
+// Lanza el trabajo en su propio grupo de procesos, con stdin en /dev/null y
+// stdout/stderr hacia tuberías propias. Si no se pudo lanzar queda como
+// terminado con código 127.
+void par_launch(struct par_job *j, int null_fd) {
+    int out[2] = {-1, -1}, err[2] = {-1, -1};
+    j->fds[0] = j->fds[1] = -1;
+    memset(&j->st, 0, sizeof(j->st));
+    j->state = PJ_RUNNING;
+    clock_gettime(CLOCK_REALTIME, &j->start_wall);
+    clock_gettime(CLOCK_MONOTONIC, &j->st.start);
+    if (pipe2(out, O_CLOEXEC) == -1 || pipe2(err, O_CLOEXEC) == -1) {
+        perror("parallel: pipe");
+        if (out[0] != -1) { close(out[0]); close(out[1]); }
+        j->st.pid = -1;
+    } else {
+        j->st.pid = spawn_command(j->argv, NULL, null_fd, out[1], err[1], 0);
+        close(out[1]);
+        close(err[1]);
+        j->fds[0] = out[0];
+        j->fds[1] = err[0];
+        fcntl(out[0], F_SETFL, O_NONBLOCK);
+        fcntl(err[0], F_SETFL, O_NONBLOCK);
+    }
+    if (j->st.pid == -1) {
+        j->st.status = 127 << 8;
+        j->st.done = 1;
+        clock_gettime(CLOCK_MONOTONIC, &j->st.end);
+    }
+}
 
-    for (i = 0; i < n; ++i) {
-        int pipefd[2] = {-1, -1};
-        if (i < n-1) {
-            if (pipe(pipefd) == -1) {
-                perror("pipe");
-                return -1;
+// Vuelca la salida retenida de un trabajo de una vez y la libera. Los fallos
+// se informan justo después de su salida.
+void par_flush(struct par_job *j) {
+    for (int k = 0; k < 2; ++k) {
+        struct out_buf *b = &j->out[k];
+        size_t off = 0;
+        while (off < b->len) {
+            ssize_t w = write(k ? STDERR_FILENO : STDOUT_FILENO, b->data + off, b->len - off);
+            if (w == -1 && errno == EINTR) continue;
+            if (w <= 0) break;
+            off += w;
+        }
+        free(b->data);
+        b->data = NULL;
+        b->len = b->cap = 0;
+    }
+    int status = j->st.status;
+    if (status != 0) {
+        fprintf(stderr, "parallel: falló (%s %d):", WIFSIGNALED(status) ? "señal" : "salida",
+            WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+        for (int i = 0; j->argv[i]; ++i) fprintf(stderr, " %s", j->argv[i]);
+        fputc('\n', stderr);
+    }
+    j->state = PJ_FLUSHED;
+}
+
+// parallel [-j N] [-k] [--joblog archivo] [--halt soon|now] cmd args... [::: args...]
+// Corre cmd una vez por argumento (de ::: o de las líneas de la entrada
+// estándar) con a lo sumo N trabajos a la vez. La salida de cada trabajo se
+// retiene y se escribe entera al terminar, así que no se mezcla; con -k se
+// escribe en el orden de los argumentos. Devuelve cuántos fallaron (hasta 101).
+int builtin_parallel(char **argv) {
+    static const char *usage_msg =
+        "uso: parallel [-j N] [-k] [--joblog archivo] [--halt soon|now] comando [args...] [::: args...]\n";
+    long nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep = 0, halt_mode = 0;    // 1 = soon (no lanzar más), 2 = now (matar los que corren)
+    struct miprof_opts log = { .format = FMT_CSV, .metrics_fd = -1 };
+    int a = 1;
+    for (; argv[a] && argv[a][0] == '-'; ++a) {
+        if (strcmp(argv[a], "-k") == 0) { keep = 1; continue; }
+        // El resto de las opciones llevan valor; una desconocida o sin valor
+        // es un error, no el comienzo del comando
+        const char *opt = argv[a++];
+        if (!argv[a]) { fprintf(stderr, "%s", usage_msg); goto fail; }
+        if (strcmp(opt, "-j") == 0) {
+            char *end;
+            nworkers = strtol(argv[a], &end, 10);
+            if (*end != '\0' || nworkers <= 0) { fprintf(stderr, "parallel: -j inválido: %s\n", argv[a]); goto fail; }
+        } else if (strcmp(opt, "--joblog") == 0) {
+            if (log.metrics_fd != -1) close(log.metrics_fd);
+            log.metrics_fd = open(argv[a], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (log.metrics_fd == -1) { perror("parallel: joblog"); goto fail; }
+        } else if (strcmp(opt, "--halt") == 0) {
+            if (strcmp(argv[a], "soon") == 0) halt_mode = 1;
+            else if (strcmp(argv[a], "now") == 0) halt_mode = 2;
+            else { fprintf(stderr, "%s", usage_msg); goto fail; }
+        } else {
+            fprintf(stderr, "%s", usage_msg);
+            goto fail;
+        }
+    }
+    if (nworkers < 1) nworkers = 1;
+
+    // Plantilla hasta ":::"; sin ":::" los argumentos son las líneas de stdin
+    char **tmpl = &argv[a];
+    int tc = 0;
+    while (tmpl[tc] && strcmp(tmpl[tc], ":::") != 0) tc++;
+    if (tc == 0) { fprintf(stderr, "%s", usage_msg); goto fail; }
+    char **args = NULL;
+    char *input = NULL;
+    int nargs = 0;
+    if (tmpl[tc]) {
+        args = &tmpl[tc + 1];
+        while (args[nargs]) nargs++;
+    } else {
+        size_t len = 0, cap = 0;
+        while (1) {
+            if (cap - len < 4096) {
+                char *d = realloc(input, cap = cap ? cap * 2 : 65536);
+                if (!d) { perror("parallel"); free(input); goto fail; }
+                input = d;
             }
+            ssize_t r = read(STDIN_FILENO, input + len, cap - len - 1);
+            if (r == -1 && errno == EINTR) continue;
+            if (r <= 0) break;
+            len += r;
         }
+        if (!input) goto fail;
+        input[len] = '\0';
+        for (size_t i = 0; i < len; ++i) if (input[i] == '\n') nargs++;
+        if (len > 0 && input[len-1] != '\n') nargs++;
+        args = malloc(sizeof(char*) * (nargs + 1));
+        if (!args) { perror("parallel"); free(input); goto fail; }
+        int k = 0;
+        for (char *p = input, *nl; k < nargs; p = nl + 1) {
+            nl = strchr(p, '\n');
+            if (!nl) nl = input + len;
+            *nl = '\0';
+            args[k++] = p;
+        }
+        args[k] = NULL;
+    }
 
-        pid_t pid = fork();
-        if (pid == -1) {
-            perror("fork");
-            return -1;
+    struct par_job *jobs = calloc(nargs ? nargs : 1, sizeof(*jobs));
+    int *active = malloc(sizeof(int) * nworkers);
+    struct pollfd *pfd = malloc(sizeof(*pfd) * (1 + 2 * nworkers));
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int failed = 0, nactive = 0, next = 0, flush_next = 0, halt = 0;
+    if (!jobs || !active || !pfd) { perror("parallel"); nargs = 0; }
+    got_sigint = 0;
+
+    while ((next < nargs && !halt) || nactive > 0) {
+        while (!halt && next < nargs && nactive < nworkers) {
+            struct par_job *j = &jobs[next];
+            j->argv = par_build_argv(tmpl, tc, args[next]);
+            if (!j->argv) { perror("parallel"); halt = 1; break; }
+            par_launch(j, null_fd);
+            active[nactive++] = next++;
         }
-        if (pid == 0) {
-            if (in_fd != STDIN_FILENO) {
-                dup2(in_fd, STDIN_FILENO);
-                close(in_fd);
+
+        // Espera datos de algún trabajo o SIGCHLD
+        int np = 0;
+        pfd[np++] = (struct pollfd){ .fd = sigchld_fd, .events = POLLIN };
+        for (int i = 0; i < nactive; ++i)
+            for (int k = 0; k < 2; ++k)
+                if (jobs[active[i]].fds[k] != -1)
+                    pfd[np++] = (struct pollfd){ .fd = jobs[active[i]].fds[k], .events = POLLIN };
+        if (poll(pfd, np, -1) == -1 && errno != EINTR) { perror("poll"); break; }
+        drain_sigchld();
+        if (got_sigint && !halt) {
+            // Ctrl-C: no se lanzan más y se reenvía a cada grupo (ninguno
+            // tiene la terminal)
+            halt = 1;
+            for (int i = 0; i < nactive; ++i)
+                if (!jobs[active[i]].st.done) kill(-jobs[active[i]].st.pid, SIGINT);
+        }
+
+        for (int i = 0; i < nactive; ) {
+            struct par_job *j = &jobs[active[i]];
+            for (int k = 0; k < 2; ++k)
+                if (j->fds[k] != -1 && !out_buf_read(&j->out[k], j->fds[k])) {
+                    close(j->fds[k]);
+                    j->fds[k] = -1;
+                }
+            reap_stages(&j->st, 1, 0);
+            if (!j->st.done || j->fds[0] != -1 || j->fds[1] != -1) { i++; continue; }
+
+            // Terminó y se leyó toda su salida
+            j->state = PJ_FINISHED;
+            active[i] = active[--nactive];
+            if (log.metrics_fd != -1 && j->st.pid != -1) {
+                struct prof_result r = {
+                    .real_sec = ts_diff(&j->st.start, &j->st.end),
+                    .usr_sec = j->st.usage.ru_utime.tv_sec + j->st.usage.ru_utime.tv_usec/1e6,
+                    .sys_sec = j->st.usage.ru_stime.tv_sec + j->st.usage.ru_stime.tv_usec/1e6,
+                    .maxrss = j->st.usage.ru_maxrss, .usage = j->st.usage,
+                    .start_wall = j->start_wall, .pid = j->st.pid, .status = j->st.status,
+                };
+                write_metrics_record(log.metrics_fd, &log, j->argv, &r);
             }
-            if (i < n-1) {
-                close(pipefd[0]);
-                dup2(pipefd[1], STDOUT_FILENO);
-                close(pipefd[1]);
+            if (j->st.status != 0) {
+                failed++;
+                if (halt_mode && !halt) {
+                    halt = 1;
+                    if (halt_mode == 2)
+                        for (int k = 0; k < nactive; ++k)
+                            if (!jobs[active[k]].st.done) kill(-jobs[active[k]].st.pid, SIGTERM);
+                }
             }
-            // Argumentos
-            char *cmdcopy = strdup(commands[i]);
-            char **argv = parse_args(cmdcopy);
-            if (argv[0] == NULL) exit(0);
-            execvp(argv[0], argv);
-            // Si execvp retorna, hubo error
-            fprintf(stderr, "mishell: %s: %s\n", argv[0], strerror(errno));
-            exit(127);
-        } else {
-            pids[i] = pid;
-            if (in_fd != STDIN_FILENO) close(in_fd);
-            if (i < n-1) {
-                close(pipefd[1]);
-                in_fd = pipefd[0];
+            if (!keep) par_flush(j);
+        }
+        // Con -k se vuelca en orden lo que ya está completo
+        while (keep && flush_next < next && jobs[flush_next].state == PJ_FINISHED) par_flush(&jobs[flush_next++]);
+    }
+
+    if (halt && next < nargs)
+        fprintf(stderr, "parallel: detenido, %d trabajos sin lanzar\n", nargs - next);
+    if (failed) fprintf(stderr, "parallel: %d de %d trabajos fallaron\n", failed, next);
+    for (int i = 0; i < next; ++i) free(jobs[i].argv);
+    free(jobs);
+    free(active);
+    free(pfd);
+    if (null_fd != -1) close(null_fd);
+    if (input) { free(input); free(args); }
+    if (log.metrics_fd != -1) close(log.metrics_fd);
+    return failed > 101 ? 101 : failed;
+
+fail:
+    if (log.metrics_fd != -1) close(log.metrics_fd);
+    return 255;
+}
+
+// Directorio de trabajo lógico (como $PWD): lo mantiene cd, así que el
+// prompt no llama a getcwd en cada línea y no tiene límite de largo
+static char *shell_pwd = NULL;
+
+// Une dir a base (si dir es relativo) y resuelve ".", ".." y "//" sobre el
+// texto, sin seguir enlaces simbólicos. Devuelve una cadena nueva.
+char *path_clean(const char *base, const char *dir) {
+    size_t blen = dir[0] == '/' ? 0 : strlen(base);
+    char *out = malloc(blen + strlen(dir) + 3);
+    if (!out) return NULL;
+    size_t n = 0;
+    out[0] = '\0';
+    for (int pass = 0; pass < 2; ++pass) {
+        const char *p = pass == 0 ? (blen ? base : "") : dir;
+        while (*p) {
+            while (*p == '/') p++;
+            const char *e = p;
+            while (*e && *e != '/') e++;
+            size_t len = e - p;
+            if (len == 0 || (len == 1 && p[0] == '.')) {
+                // Nada que agregar
+            } else if (len == 2 && p[0] == '.' && p[1] == '.') {
+                while (n > 0 && out[n-1] != '/') n--;
+                if (n > 0) n--;
+            } else {
+                out[n++] = '/';
+                memcpy(out + n, p, len);
+                n += len;
             }
+            p = e;
         }
     }
+    if (n == 0) out[n++] = '/';
+    out[n] = '\0';
+    return out;
+}
 
-    // Esperar la ejecución en primer plano
-    int status = 0;
-    for (i = 0; i < n; ++i) {
-        current_child = pids[i];
-        waitpid(pids[i], &status, 0);
+// Toma $PWD si es absoluto y apunta al mismo directorio que "."; si no,
+// el camino físico de getcwd
+void init_pwd(void) {
+    const char *env = getenv("PWD");
+    struct stat a, b;
+    if (env && env[0] == '/' && stat(env, &a) == 0 && stat(".", &b) == 0 &&
+        a.st_dev == b.st_dev && a.st_ino == b.st_ino)
+        shell_pwd = path_clean("/", env);
+    else
+        shell_pwd = getcwd(NULL, 0);
+    if (shell_pwd) setenv("PWD", shell_pwd, 1);
+}
+
+// cd [dir|-]: sin argumento va a $HOME y con "-" a $OLDPWD (y lo muestra).
+// El destino se resuelve en forma lógica sobre el directorio actual; si ese
+// camino no existe (p. ej. ".." tras un enlace roto) se prueba el físico.
+// Actualiza $PWD y $OLDPWD.
+int builtin_cd(char **argv) {
+    const char *dir = argv[1];
+    int show = 0;
+    if (!dir) {
+        dir = getenv("HOME");
+        if (!dir) { fprintf(stderr, "mishell: cd: HOME no está definido\n"); return 1; }
+    } else if (strcmp(dir, "-") == 0) {
+        dir = getenv("OLDPWD");
+        if (!dir) { fprintf(stderr, "mishell: cd: OLDPWD no está definido\n"); return 1; }
+        show = 1;
     }
-    current_child = 0;
-    return status;
+
+    char *target = shell_pwd ? path_clean(shell_pwd, dir) : NULL;
+    if (!target || chdir(target) == -1) {
+        free(target);
+        if (chdir(dir) == -1) {
+            fprintf(stderr, "mishell: cd: %s: %s\n", dir, strerror(errno));
+            return 1;
+        }
+        target = getcwd(NULL, 0);
+    }
+    if (shell_pwd) setenv("OLDPWD", shell_pwd, 1);
+    free(shell_pwd);
+    shell_pwd = target;
+    if (shell_pwd) setenv("PWD", shell_pwd, 1);
+    if (show) printf("%s\n", shell_pwd ? shell_pwd : dir);
+    return 0;
 }
 
-// Ejecuta un comando único y opcionalmente mide tiempo y recursos
-int run_and_profile(char **argv, int save_to_file, const char *filename, int timeout_seconds) {
-    struct timespec start, end;
-    struct rusage usage;
-    pid_t pid;
+// exit [n]: termina la shell con código n (0 por omisión)
+int builtin_exit(char **argv) {
+    if (!argv[1]) exit(exit_code(last_status));
+    char *end;
+    errno = 0;
+    long code = strtol(argv[1], &end, 10);
+    if (*end != '\0' || end == argv[1] || errno) {
+        fprintf(stderr, "mishell: exit: %s: se esperaba un número\n", argv[1]);
+        exit(2);
+    }
+    exit(code & 0xff);
+}
 
-    int tmpfd = -1;
-    char tmpname[] = "/tmp/miprof_out_XXXXXX";
+// spawn [fork|posix_spawn]: muestra o cambia el backend de lanzamiento
+int builtin_spawn(char **argv) {
+    if (!argv[1]) printf("spawn: %s\n", spawn_backend == SPAWN_POSIX ? "posix_spawn" : "fork");
+    else if (set_spawn_backend(argv[1]) == -1) {
+        fprintf(stderr, "uso: spawn [fork|posix_spawn]\n");
+        return 1;
+    }
+    return 0;
+}
 
-    if (save_to_file) {
-        tmpfd = mkstemp(tmpname);
-        if (tmpfd == -1) {
-            perror("mkstemp");
-            return -1;
+// trace [archivo|off]: muestra, inicia o termina la traza de ejecución
+int builtin_trace(char **argv) {
+    if (!argv[1]) {
+        if (trace_ring) printf("trace: activa (%u eventos pendientes)\n", trace_head - trace_tail);
+        else printf("trace: off\n");
+    } else if (strcmp(argv[1], "off") == 0) {
+        trace_stop();
+    } else if (trace_start(argv[1]) == -1) {
+        fprintf(stderr, "trace: %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Valor bajo el que cae la fracción p de las muestras (cota superior de su
+// casilla, sin pasar del máximo observado)
+unsigned long long hist_percentile(const struct phase_hist *h, double p) {
+    unsigned long long want = (unsigned long long)ceil(p * h->count), seen = 0;
+    for (unsigned b = 0; b < HIST_BUCKETS; ++b) {
+        seen += h->hist[b];
+        if (seen >= want && seen > 0) {
+            unsigned long long v = hist_upper(b);
+            return v < h->max_ns ? v : h->max_ns;
         }
     }
+    return h->max_ns;
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &start);
+// stats [reset]: latencias de las fases propias de la shell
+int builtin_stats(char **argv) {
+    static const char *names[NSTAT_PHASES] = {
+        "leer línea", "parsear", "resolver PATH", "lanzar", "esperar", "prompt",
+    };
+    if (argv[1]) {
+        if (strcmp(argv[1], "reset") != 0) {
+            fprintf(stderr, "uso: stats [reset]\n");
+            return 2;
+        }
+        memset(shell_stats, 0, sizeof(shell_stats));
+        return 0;
+    }
+    printf("%-14s%10s%12s%10s%10s%10s%10s%10s\n", "fase (us)", "n", "total(ms)", "media",
+        "p50", "p90", "p99", "max");
+    for (int i = 0; i < NSTAT_PHASES; ++i) {
+        const struct phase_hist *h = &shell_stats[i];
+        if (!h->count) continue;
+        // printf rellena por bytes: se suman los de continuación UTF-8 (tildes)
+        int pad = 14;
+        for (const char *c = names[i]; *c; ++c) if ((*c & 0xC0) == 0x80) pad++;
+        printf("%-*s%10llu%12.3f%10.1f%10.1f%10.1f%10.1f%10.1f\n", pad, names[i], h->count,
+            h->total_ns / 1e6, (double)h->total_ns / h->count / 1e3, hist_percentile(h, 0.5) / 1e3,
+            hist_percentile(h, 0.9) / 1e3, hist_percentile(h, 0.99) / 1e3, h->max_ns / 1e3);
+    }
+    // Resolver PATH ocurre dentro de lanzar: no se suma dos veces
+    unsigned long long own = shell_stats[ST_READ].total_ns + shell_stats[ST_PARSE].total_ns
+        + shell_stats[ST_SPAWN].total_ns + shell_stats[ST_PROMPT].total_ns;
+    printf("Shell: %.3f ms (leer, parsear, lanzar, prompt)  Comandos: %.3f ms esperando\n",
+        own / 1e6, shell_stats[ST_WAIT].total_ns / 1e6);
 
-    pid = fork();
-    if (pid == -1) { perror("fork"); return -1; }
-    if (pid == 0) {
-        if (save_to_file) {
-            dup2(tmpfd, STDOUT_FILENO);
-            dup2(tmpfd, STDERR_FILENO);
-            close(tmpfd);
+    // Lo que cuesta medir: dos lecturas del reloj por fase
+    long long t0 = now_ns(), t1 = t0;
+    for (int i = 0; i < 1000; ++i) t1 = now_ns();
+    printf("Costo de medir: %.0f ns por fase\n", (t1 - t0) / 1000.0 * 2);
+    return 0;
+}
+
+// pipesize [bytes[K|M]|default]: muestra o cambia la capacidad de las tuberías
+int builtin_pipesize(char **argv) {
+    if (!argv[1]) {
+        if (pipe_size > 0) printf("pipesize: %d (máximo %ld)\n", pipe_size, pipe_max_size());
+        else printf("pipesize: default (máximo %ld)\n", pipe_max_size());
+    } else if (set_pipe_size(argv[1]) == -1) {
+        fprintf(stderr, "uso: pipesize [bytes[K|M]|default]\n");
+        return 1;
+    }
+    return 0;
+}
+
+// pwd [-L|-P]: el directorio lógico que mantiene cd, o el físico con -P
+int builtin_pwd(char **argv) {
+    int physical = argv[1] && strcmp(argv[1], "-P") == 0;
+    if (!physical && shell_pwd) {
+        puts(shell_pwd);
+        return 0;
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        fprintf(stderr, "mishell: pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    puts(cwd);
+    free(cwd);
+    return 0;
+}
+
+int builtin_true(char **argv) { (void)argv; return 0; }
+int builtin_false(char **argv) { (void)argv; return 1; }
+
+// Escribe la secuencia con barra que empieza en s y devuelve el último
+// carácter consumido. Con zero_octal el octal lleva un 0 delante (\0NNN, como
+// en echo -e y %b); si no, son hasta tres dígitos (\NNN, formato de printf).
+// \c pone *stop en 1: no se escribe nada más.
+const char *put_escape(const char *s, int zero_octal, int *stop) {
+    char c = *++s;
+    switch (c) {
+    case 'a': putchar('\a'); break;
+    case 'b': putchar('\b'); break;
+    case 'e': putchar('\033'); break;
+    case 'f': putchar('\f'); break;
+    case 'n': putchar('\n'); break;
+    case 'r': putchar('\r'); break;
+    case 't': putchar('\t'); break;
+    case 'v': putchar('\v'); break;
+    case '\\': putchar('\\'); break;
+    case 'c': *stop = 1; break;
+    case '\0': putchar('\\'); return s - 1;
+    default:
+        if (zero_octal ? c == '0' : (c >= '0' && c <= '7')) {
+            const char *d = zero_octal ? s + 1 : s;
+            int v = 0;
+            for (int k = 0; k < 3 && *d >= '0' && *d <= '7'; ++k) v = v * 8 + (*d++ - '0');
+            putchar(v);
+            return d - 1;
         }
-        if (timeout_seconds > 0) {
-            // activar alarma local
-            alarm(timeout_seconds);
+        putchar('\\');
+        putchar(c);
+    }
+    return s;
+}
+
+// Escribe s interpretando las secuencias con barra. Devuelve 1 si hubo \c.
+int put_escaped(const char *s, int zero_octal) {
+    int stop = 0;
+    for (; *s && !stop; ++s) {
+        if (*s == '\\') s = put_escape(s, zero_octal, &stop);
+        else putchar(*s);
+    }
+    return stop;
+}
+
+// echo [-neE] args...: -n sin salto de línea final, -e interpreta las
+// secuencias con barra (\n, \t, \0NNN, \c...)
+int builtin_echo(char **argv) {
+    int newline = 1, esc = 0, i = 1;
+    for (; argv[i] && argv[i][0] == '-' && argv[i][1]; ++i) {
+        const char *f = argv[i] + 1;
+        if (f[strspn(f, "neE")] != '\0') break;
+        for (; *f; ++f) {
+            if (*f == 'n') newline = 0;
+            else esc = *f == 'e';
         }
-        execvp(argv[0], argv);
-        fprintf(stderr, "mishell: %s: %s\n", argv[0], strerror(errno));
-        _exit(127);
     }
+    for (int first = i; argv[i]; ++i) {
+        if (i > first) putchar(' ');
+        if (!esc) fputs(argv[i], stdout);
+        else if (put_escaped(argv[i], 1)) return 0;
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+// Argumento numérico de printf: entero en base 10, 8 (0...) o 16 (0x...), o
+// el código del carácter si empieza con comilla
+long long printf_int(const char *s, int *rc) {
+    if (!s) return 0;
+    if (s[0] == '\'' || s[0] == '"') return (unsigned char)s[1];
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 0);
+    if (*end != '\0' || end == s || errno) {
+        fprintf(stderr, "mishell: printf: %s: número inválido\n", s);
+        *rc = 1;
+    }
+    return v;
+}
 
-    current_child = pid;
+// printf formato [args...]: %s %b %c %d %i %o %u %x %X %e %E %f %g %G %% con
+// banderas, ancho y precisión (también *). El formato se repite mientras
+// queden argumentos; los que faltan valen "" o 0.
+int builtin_printf(char **argv) {
+    const char *fmt = argv[1];
+    char **args = argv + 2;
+    int rc = 0, stop = 0;
+    do {
+        char **first = args;
+        for (const char *p = fmt; *p && !stop; ++p) {
+            if (*p == '\\') { p = put_escape(p, 0, &stop); continue; }
+            if (*p != '%') { putchar(*p); continue; }
+            if (p[1] == '%') { putchar('%'); p++; continue; }
 
-    int status = 0;
-    if (timeout_seconds > 0) {
-        // Espera con límite de tiempo
-        int waited = 0;
-        while (1) {
-            pid_t w = waitpid(pid, &status, WNOHANG);
-            if (w == pid) break;
-            if (w == -1) { perror("waitpid"); break; }
-            if (waited >= timeout_seconds) {
-                kill(pid, SIGKILL);
-                waitpid(pid, &status, 0);
+            // Especificación: %[banderas][ancho][.precisión]conversión
+            char spec[64];
+            int n = 0;
+            spec[n++] = '%';
+            for (++p; *p && strchr("-+ #0", *p) && n < 8; ++p) spec[n++] = *p;
+            for (int part = 0; part < 2; ++part) {
+                if (part == 1) {
+                    if (*p != '.') break;
+                    spec[n++] = *p++;
+                }
+                if (*p == '*') {
+                    n += snprintf(spec + n, 16, "%d", (int)printf_int(*args, &rc));
+                    if (*args) args++;
+                    p++;
+                } else {
+                    for (; *p >= '0' && *p <= '9' && n < 40; ++p) spec[n++] = *p;
+                }
+            }
+            const char *arg = *args ? *args++ : NULL;
+            char conv = *p;
+            switch (conv) {
+            case 'd': case 'i':
+                spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+                printf(spec, printf_int(arg, &rc));
+                break;
+            case 'o': case 'u': case 'x': case 'X':
+                spec[n++] = 'l'; spec[n++] = 'l'; spec[n++] = conv; spec[n] = '\0';
+                printf(spec, (unsigned long long)printf_int(arg, &rc));
+                break;
+            case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': {
+                char *end = NULL;
+                double v = arg ? strtod(arg, &end) : 0;
+                if (arg && (*end != '\0' || end == arg)) {
+                    fprintf(stderr, "mishell: printf: %s: número inválido\n", arg);
+                    rc = 1;
+                }
+                spec[n++] = conv; spec[n] = '\0';
+                printf(spec, v);
+                break;
+            }
+            case 'c':
+                spec[n++] = 'c'; spec[n] = '\0';
+                if (arg && arg[0]) printf(spec, arg[0]);
+                break;
+            case 's':
+                spec[n++] = 's'; spec[n] = '\0';
+                printf(spec, arg ? arg : "");
                 break;
+            case 'b':
+                if (arg) stop = put_escaped(arg, 1);
+                break;
+            default:
+                fprintf(stderr, "mishell: printf: %%%c: conversión inválida\n", conv ? conv : ' ');
+                return 1;
             }
-            sleep(1);
-            waited++;
         }
-    } else {
-        waitpid(pid, &status, 0);
-    }
+        // El formato se reusa solo si consumió argumentos
+        if (args == first) break;
+    } while (*args && !stop);
+    return rc;
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &end);
-    getrusage(RUSAGE_CHILDREN, &usage);
+// Evaluación de test: expr := and (-o and)*, and := not (-a not)*,
+// not := ! not | ( expr ) | unario arg | arg binario arg | arg
+struct test_state {
+    char **a;
+    int n, i;
+    int err;        // 1 = error de sintaxis, 2 = error ya informado
+};
 
-    double real_sec = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
-    double usr_sec = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1e6;
-    double sys_sec = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1e6;
-    long maxrss = usage.ru_maxrss; // en Linux: kilobytes
+int test_int(struct test_state *t, const char *s, long long *v) {
+    char *end;
+    errno = 0;
+    *v = strtoll(s, &end, 10);
+    while (*end == ' ' || *end == '\t') end++;
+    if (*end != '\0' || end == s || errno) {
+        fprintf(stderr, "mishell: test: %s: se esperaba un entero\n", s);
+        t->err = 2;
+        return -1;
+    }
+    return 0;
+}
 
-    // Crear resumen
-    char summary[1024];
-    int n = snprintf(summary, sizeof(summary),
-        "Comando: %s\nReal: %.6fs  Usuario: %.6fs  Sistema: %.6fs  MaxRSS: %ld\nExitStatus: %d\n",
-        argv[0], real_sec, usr_sec, sys_sec, maxrss, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+int test_is_binary(const char *op) {
+    static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+        "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+    for (int i = 0; ops[i]; ++i)
+        if (strcmp(op, ops[i]) == 0) return 1;
+    return 0;
+}
 
-    if (save_to_file && tmpfd != -1) {
-        // Guardar salida + resumen en archivo
-        int outfd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (outfd == -1) {
-            perror("abrir archivo de salida");
-        } else {
-            dprintf(outfd, "---- miprof append: %s ----\n", argv[0]);
-            lseek(tmpfd, 0, SEEK_SET);
-            char buf[4096];
-            ssize_t r;
-            while ((r = read(tmpfd, buf, sizeof(buf))) > 0) write(outfd, buf, r);
-            write(outfd, summary, n);
-            write(outfd, "\n", 1);
-            close(outfd);
-        }
-        close(tmpfd);
-        unlink(tmpname);
-    } else if (save_to_file == 0) {
-        // Mostrar resumen en pantalla
-        write(STDOUT_FILENO, summary, n);
+int test_binary(struct test_state *t, const char *l, const char *op, const char *r) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(l, r) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(l, r) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(l, r) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(l, r) > 0;
+    if (op[1] == 'n' || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) {
+        // -nt, -ot, -ef: comparan archivos
+        struct stat a, b;
+        int ha = stat(l, &a) == 0, hb = stat(r, &b) == 0;
+        if (strcmp(op, "-ef") == 0) return ha && hb && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+        if (op[1] == 'n' && op[2] == 't') {
+            if (!ha) return 0;
+            if (!hb) return 1;
+            return a.st_mtim.tv_sec > b.st_mtim.tv_sec ||
+                (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec > b.st_mtim.tv_nsec);
+        }
+        if (strcmp(op, "-ot") == 0) {
+            if (!hb) return 0;
+            if (!ha) return 1;
+            return a.st_mtim.tv_sec < b.st_mtim.tv_sec ||
+                (a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec < b.st_mtim.tv_nsec);
+        }
     }
+    long long x, y;
+    if (test_int(t, l, &x) == -1 || test_int(t, r, &y) == -1) return 0;
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
 
-    current_child = 0;
-    return status;
+// Operador unario: devuelve su valor, o -1 si op no es uno
+int test_unary(const char *op, const char *arg) {
+    if (op[0] != '-' || !op[1] || op[2]) return -1;
+    struct stat st;
+    switch (op[1]) {
+    case 'z': return arg[0] == '\0';
+    case 'n': return arg[0] != '\0';
+    case 't': return isatty(atoi(arg));
+    case 'e': return stat(arg, &st) == 0;
+    case 'f': return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+    case 'd': return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+    case 'b': return stat(arg, &st) == 0 && S_ISBLK(st.st_mode);
+    case 'c': return stat(arg, &st) == 0 && S_ISCHR(st.st_mode);
+    case 'p': return stat(arg, &st) == 0 && S_ISFIFO(st.st_mode);
+    case 'S': return stat(arg, &st) == 0 && S_ISSOCK(st.st_mode);
+    case 's': return stat(arg, &st) == 0 && st.st_size > 0;
+    case 'g': return stat(arg, &st) == 0 && (st.st_mode & S_ISGID);
+    case 'u': return stat(arg, &st) == 0 && (st.st_mode & S_ISUID);
+    case 'k': return stat(arg, &st) == 0 && (st.st_mode & S_ISVTX);
+    case 'h': case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    }
+    return -1;
 }
 
-// Procesa un comando
-int handle_single_command(char *cmdline) {
-    char *copy = strdup(cmdline);
-    char **argv = parse_args(copy);
-    if (argv[0] == NULL) { free(argv); free(copy); return 0; }
+int test_or(struct test_state *t);
 
-    if (strcmp(argv[0], "exit") == 0) {
-        exit(0);
+int test_not(struct test_state *t) {
+    if (t->i >= t->n) { t->err = 1; return 0; }
+    char **a = t->a;
+    int i = t->i;
+    // Un binario tiene prioridad: [ ! = x ] compara "!" con "x"
+    if (i + 2 < t->n && test_is_binary(a[i+1])) {
+        t->i += 3;
+        return test_binary(t, a[i], a[i+1], a[i+2]);
     }
-    if (strcmp(argv[0], "cd") == 0) {
-        if (argv[1]) chdir(argv[1]);
-        free(argv); free(copy);
-        return 0;
+    // Un '!' solo es un argumento más (no vacío)
+    if (strcmp(a[i], "!") == 0 && i + 1 < t->n) {
+        t->i++;
+        return !test_not(t);
+    }
+    if (strcmp(a[i], "(") == 0 && i + 1 < t->n) {
+        t->i++;
+        int v = test_or(t);
+        if (t->i >= t->n || strcmp(t->a[t->i], ")") != 0) t->err = 1;
+        else t->i++;
+        return v;
+    }
+    if (i + 1 < t->n) {
+        int v = test_unary(a[i], a[i+1]);
+        if (v != -1) {
+            t->i += 2;
+            return v;
+        }
+    }
+    // Un solo argumento: verdadero si no está vacío
+    t->i++;
+    return a[i][0] != '\0';
+}
+
+int test_and(struct test_state *t) {
+    int v = test_not(t);
+    while (!t->err && t->i < t->n && strcmp(t->a[t->i], "-a") == 0) {
+        t->i++;
+        v = test_not(t) && v;
+    }
+    return v;
+}
+
+int test_or(struct test_state *t) {
+    int v = test_and(t);
+    while (!t->err && t->i < t->n && strcmp(t->a[t->i], "-o") == 0) {
+        t->i++;
+        v = test_and(t) || v;
     }
+    return v;
+}
 
-    if (strcmp(argv[0], "miprof") == 0) {
-        if (!argv[1]) {
-            fprintf(stderr, "uso: miprof [ejec|ejcsave archivo|maxtiempo segs] comando args...\n");
-            free(argv); free(copy); return 0;
+// test expr y [ expr ]: 0 si es verdadera, 1 si es falsa, 2 si hay error
+int builtin_test(char **argv) {
+    int n = 0;
+    while (argv[n + 1]) n++;
+    if (strcmp(argv[0], "[") == 0) {
+        if (n == 0 || strcmp(argv[n], "]") != 0) {
+            fprintf(stderr, "mishell: [: falta ']'\n");
+            return 2;
         }
-        if (strcmp(argv[1], "ejec") == 0) {
-            if (!argv[2]) { fprintf(stderr, "no se indicó comando para ejec\n"); }
-            else {
-                char **cmd = &argv[2];
-                run_and_profile(cmd, 0, NULL, 0);
-            }
-        } else if (strcmp(argv[1], "ejecsave") == 0) {
-            if (!argv[2] || !argv[3]) { fprintf(stderr, "uso: miprof ejecsave archivo comando args...\n"); }
-            else {
-                const char *file = argv[2];
-                char **cmd = &argv[3];
-                run_and_profile(cmd, 1, file, 0);
-            }
-        } else if (strcmp(argv[1], "maxtiempo") == 0) {
-            if (!argv[2] || !argv[3]) { fprintf(stderr, "uso: miprof maxtiempo segs comando args...\n"); }
-            else {
-                int secs = atoi(argv[2]);
-                char **cmd = &argv[3];
-                run_and_profile(cmd, 0, NULL, secs);
-            }
-        } else {
-            fprintf(stderr, "miprof: modo desconocido %s\n", argv[1]);
+        n--;
+    }
+    if (n == 0) return 1;
+    struct test_state t = { .a = argv + 1, .n = n };
+    int v = test_or(&t);
+    if (t.err == 2) return 2;
+    if (t.err || t.i < t.n) {
+        if (t.i < t.n) fprintf(stderr, "mishell: test: %s: argumento inesperado\n", t.a[t.i]);
+        else fprintf(stderr, "mishell: test: falta un argumento\n");
+        return 2;
+    }
+    return !v;
+}
+
+int builtin_help(char **argv);
+int builtin_compgen(char **argv);
+
+// Builtins que corren dentro de la shell (miprof se atiende aparte: recibe
+// la tubería entera). Como etapa de una tubería, perfilado o en segundo
+// plano, un builtin corre en un hijo sin exec (ver spawn_command).
+static const struct builtin builtins[] = {
+    { "exit", builtin_exit, 0, 1, "[n]", "termina la shell" },
+    { "cd", builtin_cd, 0, 1, "[dir|-]", "cambia el directorio de trabajo" },
+    { "pwd", builtin_pwd, 0, 1, "[-L|-P]", "muestra el directorio de trabajo" },
+    { "echo", builtin_echo, 0, -1, "[-neE] [args...]", "escribe sus argumentos" },
+    { "printf", builtin_printf, 1, -1, "formato [args...]", "escribe argumentos con formato" },
+    { "true", builtin_true, 0, -1, "", "termina con éxito" },
+    { "false", builtin_false, 0, -1, "", "termina con fallo" },
+    { "test", builtin_test, 0, -1, "expr", "evalúa una condición" },
+    { "[", builtin_test, 0, -1, "expr ]", "evalúa una condición" },
+    { "hash", builtin_hash, 0, -1, "[-r] [-d cmd...] [cmd...]", "caché de rutas de comandos" },
+    { "spawn", builtin_spawn, 0, 1, "[fork|posix_spawn]", "backend para lanzar procesos" },
+    { "pipesize", builtin_pipesize, 0, 1, "[bytes[K|M]|default]", "capacidad de las tuberías entre etapas" },
+    { "trace", builtin_trace, 0, 1, "[archivo|off]", "traza de ejecución en JSON para Perfetto" },
+    { "stats", builtin_stats, 0, 1, "[reset]", "latencias propias de la shell por fase" },
+    { "jobs", builtin_jobs, 0, 0, "", "lista los trabajos" },
+    { "fg", builtin_fg, 0, 1, "[%n]", "trae un trabajo al primer plano" },
+    { "bg", builtin_bg, 0, 1, "[%n]", "reanuda un trabajo en segundo plano" },
+    { "wait", builtin_wait, 0, 1, "[%n]", "espera trabajos en segundo plano" },
+    { "parallel", builtin_parallel, 1, -1,
+      "[-j N] [-k] [--joblog archivo] [--halt soon|now] comando [args...] [::: args...]",
+      "ejecuta un comando por argumento en paralelo" },
+    { "miprof", NULL, 1, -1, "[--format json|csv] [--metrics archivo|--metrics-fd N] [--cgroup auto|dir] [--memory-max B] [--cpu-max C] modo args...",
+      "perfila comandos y tuberías" },
+    { "help", builtin_help, 0, 1, "[nombre]", "muestra los builtins y su uso" },
+    { "compgen", builtin_compgen, 0, 2, "[-b|-m] [prefijo]", "lista builtins (-b) o modos de miprof (-m) que empiezan por prefijo" },
+};
+#define NBUILTINS ((int)(sizeof(builtins) / sizeof(builtins[0])))
+static struct name_index builtin_index;
+
+const struct builtin *find_builtin(const char *name) {
+    int i = name_index_find(&builtin_index, builtins, sizeof(builtins[0]), name);
+    return i == -1 ? NULL : &builtins[i];
+}
+
+// Arma los índices de builtins y de modos de miprof
+void builtin_table_init(void) {
+    name_index_build(&builtin_index, builtins, sizeof(builtins[0]), NBUILTINS);
+    name_index_build(&miprof_mode_index, miprof_modes, sizeof(miprof_modes[0]), NMIPROF_MODES);
+}
+
+// Valida la cantidad de argumentos según la tabla y llama al builtin
+int builtin_call(const struct builtin *b, char **argv) {
+    int argc = 0;
+    while (argv[argc + 1]) argc++;
+    if (argc < b->min_args || (b->max_args >= 0 && argc > b->max_args)) {
+        fprintf(stderr, "uso: %s%s%s\n", b->name, b->usage[0] ? " " : "", b->usage);
+        return 2;
+    }
+    return b->fn(argv);
+}
+
+// help [nombre]: uso de un builtin (y los modos si es miprof), o la lista
+int builtin_help(char **argv) {
+    if (argv[1]) {
+        const struct builtin *b = find_builtin(argv[1]);
+        if (!b) {
+            fprintf(stderr, "mishell: help: %s: no es un builtin\n", argv[1]);
+            return 1;
         }
-        free(argv); free(copy);
+        printf("%s%s%s\n    %s\n", b->name, b->usage[0] ? " " : "", b->usage, b->help);
+        if (!b->fn)
+            for (int i = 0; i < NMIPROF_MODES; ++i)
+                printf("  %s %s %s\n      %s\n", b->name, miprof_modes[i].name, miprof_modes[i].usage, miprof_modes[i].help);
         return 0;
     }
+    for (int i = 0; i < NBUILTINS; ++i)
+        printf("  %-10s %s\n", builtins[i].name, builtins[i].help);
+    return 0;
+}
+
+// compgen [-b|-m] [prefijo]: candidatos para completar, uno por línea
+int builtin_compgen(char **argv) {
+    int modes = 0, a = 1;
+    if (argv[a] && (strcmp(argv[a], "-b") == 0 || strcmp(argv[a], "-m") == 0)) modes = argv[a++][1] == 'm';
+    const char *prefix = argv[a] ? argv[a] : "";
+    size_t len = strlen(prefix);
+    int n = modes ? NMIPROF_MODES : NBUILTINS;
+    for (int i = 0; i < n; ++i) {
+        const char *name = modes ? miprof_modes[i].name : builtins[i].name;
+        if (strncmp(name, prefix, len) == 0) puts(name);
+    }
+    return 0;
+}
+
+// Deshace las redirecciones de un builtin (ver redirect_builtin)
+void restore_builtin(int saved[10]) {
+    fflush(stdout);
+    for (int i = 0; i < 10; ++i) {
+        if (saved[i] == -2) continue;
+        if (saved[i] == -1) close(i);
+        else { dup2(saved[i], i); close(saved[i]); }
+    }
+}
+
+// Aplica las redirecciones de un builtin en la propia shell, guardando antes
+// los descriptores que toca (-2 = no tocado, -1 = estaba cerrado)
+int redirect_builtin(const struct redir *redirs, int saved[10]) {
+    int rfds[MAX_REDIRS];
+    for (int i = 0; i < 10; ++i) saved[i] = -2;
+    for (const struct redir *r = redirs; r; r = r->next)
+        if (saved[r->fd] == -2) saved[r->fd] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+    fflush(stdout);
+    int n = open_redirs(redirs, rfds);
+    int err = n == -1 ? -1 : apply_redirs(redirs, rfds);
+    if (n != -1) close_redirs(rfds, n);
+    if (err == -1) restore_builtin(saved);
+    return err;
+}
+
+// Procesa una línea de una sola etapa, o una tubería que empieza por miprof
+int handle_single_command(struct pipeline *pl) {
+    char **argv = pl->cmds[0].argv;
+    const struct builtin *b = find_builtin(argv[0]);
+
+    if (b && !b->fn) {
+        // La primera etapa lleva miprof, sus opciones y el comando; las
+        // siguientes son las demás etapas de la tubería a perfilar. Las
+        // redirecciones son del comando perfilado.
+        trace_begin("builtin", argv[0]);
+        int code = builtin_miprof(argv, pl->cmds[0].redirs, &pl->cmds[1], pl->ncmds - 1);
+        trace_end("builtin");
+        return code << 8;
+    }
 
     // Si no ejecutar como comando externo
-    char *single = strdup(cmdline);
-    char *commands[2]; commands[0] = single; commands[1] = NULL;
-    int status = execute_pipeline(commands, 1);
-    free(single);
-    free(argv); free(copy);
+    if (!b) return execute_pipeline(pl->cmds, 1, 0);
+
+    // Los builtins corren en la shell: sus redirecciones se aplican y se
+    // deshacen alrededor
+    // trace abre o cierra la traza en medio del tramo y exit no vuelve: en
+    // ambos casos el tramo quedaría sin su 'B' o sin su 'E'
+    int span = b->fn != builtin_trace && b->fn != builtin_exit;
+    int saved[10];
+    if (span) trace_begin("builtin", argv[0]);
+    if (pl->cmds[0].redirs && redirect_builtin(pl->cmds[0].redirs, saved) == -1) {
+        if (span) trace_end("builtin");
+        return 1 << 8;
+    }
+    int code = builtin_call(b, argv);
+    if (pl->cmds[0].redirs) restore_builtin(saved);
+    else fflush(stdout);
+    if (span) trace_end("builtin");
+    return code << 8;
+}
+
+// Ejecuta una tubería: miprof recibe la tubería entera para perfilarla por
+// etapas y corre en la shell aunque lleve '&'; un builtin solo corre en la
+// shell si está solo y en primer plano. Devuelve el estado de espera de la
+// última etapa (-1 si falló).
+int run_pipeline(struct pipeline *pl, int bg) {
+    const struct builtin *b = find_builtin(pl->cmds[0].argv[0]);
+    if (b && (!b->fn || (pl->ncmds == 1 && !bg))) return handle_single_command(pl);
+    trace_begin("ejecutar", pl->cmds[0].argv[0]);
+    int status = execute_pipeline(pl->cmds, pl->ncmds, bg);
+    trace_end("ejecutar");
+    return status;
+}
+
+// Recorre la lista de izquierda a derecha sin volver al bucle de lectura.
+// Tras '&&' la siguiente tubería corre solo si la anterior terminó con
+// éxito; tras '||', solo si falló. Las saltadas no cambian el estado. Las
+// que terminan en '&' se lanzan en segundo plano y cuentan como éxito.
+int execute_list(struct cmdlist *l) {
+    int status = 0;
+    int run = 1;
+    for (; l; l = l->next) {
+        if (run) status = last_status = run_pipeline(&l->pl, l->op == L_BG);
+        run = l->op == L_SEQ || l->op == L_BG || (l->op == L_AND) == (status == 0);
+    }
     return status;
 }
 
+// Entrada no interactiva: las líneas salen de un búfer grande (script
+// mapeado, texto de -c o bloques leídos de la entrada estándar) y se cortan
+// en el lugar con memchr, sin prompt ni una llamada al sistema por línea
+#define READER_BLOCK 65536
+struct line_reader {
+    int fd;             // de donde leer más bloques (-1 = todo está en buf)
+    char *buf;
+    size_t len, pos, cap;
+    int mapped;         // buf es un mmap del script (len = tamaño del archivo)
+    char *tail;         // copia de la última línea de un mmap sin '\n' final
+};
+
+// Abre el script path con mmap privado y escribible: el parser corta las
+// palabras en el lugar y solo se copian las páginas que toca
+int reader_open_file(struct line_reader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) { close(fd); return -1; }
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *m = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            madvise(m, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            r->buf = m;
+            r->len = st.st_size;
+            r->mapped = 1;
+            return 0;
+        }
+    }
+    // Vacío, no regular o sin mmap: se lee por bloques
+    r->fd = fd;
+    return 0;
+}
+
+// Devuelve la siguiente línea terminada en '\0' (sin el '\n') y su largo en
+// *len, o NULL al final de la entrada
+char *reader_next(struct line_reader *r, size_t *len) {
+    while (1) {
+        char *start = r->buf + r->pos;
+        char *nl = r->pos < r->len ? memchr(start, '\n', r->len - r->pos) : NULL;
+        if (nl) {
+            *nl = '\0';
+            *len = nl - start;
+            r->pos = nl - r->buf + 1;
+            return start;
+        }
+        if (r->fd == -1) {
+            // Última línea sin '\n'
+            if (r->pos >= r->len) return NULL;
+            *len = r->len - r->pos;
+            r->pos = r->len;
+            if (!r->mapped) { start[*len] = '\0'; return start; }
+            free(r->tail);
+            r->tail = strndup(start, *len);
+            return r->tail;
+        }
+        // Falta el final de la línea: se corre lo pendiente al principio y
+        // se lee otro bloque (cap siempre deja lugar para el '\0')
+        size_t rest = r->len - r->pos;
+        memmove(r->buf, start, rest);
+        r->len = rest;
+        r->pos = 0;
+        if (r->cap - r->len < READER_BLOCK / 2) {
+            size_t cap = r->cap ? r->cap * 2 : READER_BLOCK;
+            char *b = realloc(r->buf, cap + 1);
+            if (!b) { perror("mishell"); return NULL; }
+            r->buf = b;
+            r->cap = cap;
+        }
+        ssize_t n = read(r->fd, r->buf + r->len, r->cap - r->len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == -1) perror("mishell: read");
+            if (r->fd != STDIN_FILENO) close(r->fd);
+            r->fd = -1;
+            continue;
+        }
+        r->len += n;
+    }
+}
+
+void reader_close(struct line_reader *r) {
+    if (r->mapped) munmap(r->buf, r->len);
+    else free(r->buf);
+    free(r->tail);
+    if (r->fd > STDIN_FILENO) close(r->fd);
+}
+
+// uso: simple_shell [-c comandos | script]
 int main(int argc, char **argv) {
-    (void)argc;
-    (void)argv;
     struct sigaction sa;
     sa.sa_handler = sigint_handler;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     sigaction(SIGINT, &sa, NULL);
+    // Ctrl-Z detiene al trabajo en primer plano, no a la shell; los hijos
+    // vuelven a la acción por defecto al lanzarse
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGTSTP, &sa, NULL);
+    sigaction(SIGTTIN, &sa, NULL);
+    sigemptyset(&job_sigs);
+    sigaddset(&job_sigs, SIGTSTP);
+    sigaddset(&job_sigs, SIGTTIN);
 
-    char *line = NULL;
-    size_t len = 0;
+    // SIGCHLD se atiende por signalfd para esperar hijos sin sondear.
+    // SIGTTOU se bloquea para poder recuperar la terminal con tcsetpgrp
+    sigset_t chld, blocked;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    blocked = chld;
+    sigaddset(&blocked, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &blocked, &orig_sigmask);
+    sigchld_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd == -1) { perror("signalfd"); return 1; }
 
-    while (1) {
-        // Prompt
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd)) != NULL) printf("mishell:%s$ ", cwd);
-        else printf("mishell$ ");
-        fflush(stdout);
+    // Permite fijar el backend de lanzamiento desde el entorno
+    const char *backend = getenv("MISHELL_SPAWN");
+    if (backend && set_spawn_backend(backend) == -1)
+        fprintf(stderr, "mishell: MISHELL_SPAWN desconocido: %s\n", backend);
+    const char *psize = getenv("MISHELL_PIPESIZE");
+    if (psize && set_pipe_size(psize) == -1)
+        fprintf(stderr, "mishell: MISHELL_PIPESIZE inválido: %s\n", psize);
+    const char *trace = getenv("MISHELL_TRACE");
+    if (trace && trace_start(trace) == -1)
+        fprintf(stderr, "mishell: MISHELL_TRACE: %s: %s\n", trace, strerror(errno));
+    // exit también cierra la traza
+    atexit(trace_stop);
 
-        ssize_t nread = getline(&line, &len, stdin);
-        if (nread == -1) {
-            // EOF (Ctrl-D)
-            printf("\n");
-            break;
+    // Sin terminal, o con script o -c, no hay prompt y la entrada se lee
+    // en bloques grandes
+    struct line_reader reader;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "mishell: -c: falta el argumento\n");
+            return 2;
+        }
+        memset(&reader, 0, sizeof(reader));
+        reader.fd = -1;
+        reader.len = strlen(argv[2]);
+        reader.buf = strdup(argv[2]);
+    } else if (argc > 1) {
+        if (reader_open_file(&reader, argv[1]) == -1) {
+            fprintf(stderr, "mishell: %s: %s\n", argv[1], strerror(errno));
+            return 127;
         }
-        // Línea vacía
-        if (nread == 1) continue;
+    } else {
+        memset(&reader, 0, sizeof(reader));
+        reader.fd = STDIN_FILENO;
+        interactive = isatty(STDIN_FILENO);
+    }
+
+    init_pwd();
+    builtin_table_init();
+
+    char *line = NULL;
+    size_t len = 0;
+    struct arena line_arena = {0};
+    int status = 0;
 
-        // Quitar '\n' final
-        if (line[nread-1] == '\n') line[nread-1] = '\0';
-        char *trimmed = trim(line);
-        if (strlen(trimmed) == 0) continue;
+    while (1) {
+        if (job_list) notify_jobs(interactive);
+        // Entre líneas la shell está ociosa: es cuando se escribe la traza
+        trace_flush(interactive);
 
-        // Dividir por tuberías
-        char *linecopy = strdup(trimmed);
-        char *commands[MAX_COMMANDS];
-        int ncmds = split_pipeline(linecopy, commands);
+        char *cur;
+        size_t n;
+        long long t0 = now_ns();
+        if (interactive) {
+            // Prompt
+            if (shell_pwd) printf("mishell:%s$ ", shell_pwd);
+            else printf("mishell$ ");
+            fflush(stdout);
+            stat_add(ST_PROMPT, now_ns() - t0);
 
-        if (ncmds <= 1) {
-            handle_single_command(trimmed);
-        } else {
-            // Ejecutar tubería (cada comando debe estar en buffer separado)
-            char *cmdcopies[MAX_COMMANDS];
-            for (int i = 0; i < ncmds; ++i) {
-                cmdcopies[i] = strdup(commands[i]);
+            ssize_t nread = getline(&line, &len, stdin);
+            if (nread == -1) {
+                // EOF (Ctrl-D)
+                printf("\n");
+                break;
             }
-            execute_pipeline(cmdcopies, ncmds);
-            for (int i = 0; i < ncmds; ++i) free(cmdcopies[i]);
+            cur = line;
+            n = nread;
+        } else if (!(cur = reader_next(&reader, &n))) {
+            break;
         }
+        // En interactivo la lectura es lo que tarda el usuario en escribir
+        long long t1 = now_ns();
+        if (!interactive) stat_add(ST_READ, t1 - t0);
 
-        free(linecopy);
+        // Una sola pasada: palabras, etapas y lista quedan en la arena de la línea
+        trace_begin("parsear", NULL);
+        int err;
+        struct cmdlist *list = parse_line(cur, n, &line_arena, &err);
+        stat_add(ST_PARSE, now_ns() - t1);
+        trace_end("parsear");
+        // Como en sh, una línea mal formada deja el código 2
+        if (list) status = execute_list(list);
+        else if (err) status = last_status = 2 << 8;
+        arena_reset(&line_arena);
     }
 
+    reader_close(&reader);
+    arena_free(&line_arena);
     free(line);
-    return 0;
+    return exit_code(status);
 }